@@ -115,15 +115,19 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown names one page of an address space, or all of its pages
+ * if ts_vaddr is TLBSHOOTDOWN_AS.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	vaddr_t ts_vaddr;
 };
 
+#define TLBSHOOTDOWN_AS  ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
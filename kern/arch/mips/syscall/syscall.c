@@ -104,6 +104,8 @@ syscall(struct trapframe *tf)
 
 	switch (callno) {
 		int whence;
+		int fd;
+		off_t offset;
 
 	    case SYS_reboot:
 		err = sys_reboot(tf->tf_a0);
@@ -135,6 +137,11 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+	    case SYS_ftruncate:
+		/* the 64-bit length is 8-aligned, in a2/a3 */
+		err = sys_ftruncate(tf->tf_a0, (((off_t)tf->tf_a2 << 32) | tf->tf_a3));
+		break;
+
 	    case SYS_close:
 		err = sys_close(tf->tf_a0, &retval);
 		break;
@@ -175,6 +182,46 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((intptr_t) tf->tf_a0, &retval);
 		break;
 
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrlimit:
+		err = sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setrlimit:
+		err = sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_mmap:
+		/* fd is the fifth argument, the 64-bit offset is 8-aligned */
+		err = copyin((userptr_t)((tf->tf_sp) + 16), &fd, sizeof(int));
+		if (!err) {
+			err = copyin((userptr_t)((tf->tf_sp) + 24), &offset, sizeof(off_t));
+		}
+		if (!err) {
+			err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       tf->tf_a3, fd, offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_msync:
+		err = sys_msync((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	    case SYS_shm_open:
+		err = sys_shm_open((const_userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+		break;
+
+	    case SYS_shm_unlink:
+		err = sys_shm_unlink((const_userptr_t)tf->tf_a0);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -38,6 +38,7 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <vm.h>
 
 ////////////////////////////////////////////////////////////
 
@@ -284,6 +285,10 @@ wait(void)
 void
 cpu_idle(void)
 {
+	/* Zeroing a free frame for later counts as something happening. */
+	if (vm_idle_zero()) {
+		return;
+	}
 	wait();
         cpu_irqonoff();
 }
@@ -103,6 +103,49 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+vm_printstats(void)
+{
+	kprintf("dumbvm: no statistics\n");
+}
+
+bool
+vm_idle_zero(void)
+{
+	return false;
+}
+
+int
+vm_set_faultaround(unsigned npages)
+{
+	/* dumbvm loads one TLB entry per fault */
+	(void)npages;
+	return ENOSYS;
+}
+
+int
+vm_set_ksm(unsigned npages)
+{
+	/* dumbvm never shares frames */
+	(void)npages;
+	return ENOSYS;
+}
+
+void
+vm_getusage(struct addrspace *as, struct rusage *ru)
+{
+	/* dumbvm maps whole segments up front and keeps no counters */
+	(void)as;
+	(void)ru;
+}
+
+void
+vm_textcache_purge(struct vnode *v)
+{
+	/* dumbvm loads whole segments, there is no text cache */
+	(void)v;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -271,10 +314,16 @@ as_deactivate(void)
 
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+		 int readable, int writeable, int executable,
+		 struct vnode *v, off_t offset, size_t filesize)
 {
 	size_t npages;
 
+	/* dumbvm loads segments eagerly in load_elf */
+	(void)v;
+	(void)offset;
+	(void)filesize;
+
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
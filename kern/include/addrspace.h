@@ -38,8 +38,11 @@
 #include <vm.h>
 #include "opt-dumbvm.h"
 #include <spinlock.h>
+#include <array.h>
+#include <platform/maxcpus.h>
 
 struct vnode;
+struct lock;
 
 
 /*
@@ -55,12 +58,19 @@ struct vnode;
 
 // for replacement algorithm
 #define PT_USED_MASK        0x800
-// 1 = in RAM, 0 = in swap
+// 1 = page has been touched; without PT_PRESENT_MASK it is in swap
 #define PT_VALID_MASK       0x400
 // 1 = changed after in RAM
 #define PT_DIRTY_MASK       0x200
 // 1 = in RAM, 0 = in swap
 #define PT_PRESENT_MASK     0x100
+// 1 = frame shared with another address space, copy before writing
+#define PT_COW_MASK         0x080
+// 1 = in RAM and clean, and the swap slot it came from still holds it
+#define PT_SWAPCACHE_MASK   0x040
+// 1 = frame of shared memory or a shared file mapping, stays shared
+// across fork
+#define PT_SHARED_MASK      0x020
 
  // number of entries in a pagetable, PAGE_SIZE / 4
 #define NUM_PTE             1024
@@ -75,6 +85,47 @@ struct pagetable {
     pagetable_t pt_entries[PAGE_SIZE / 4];
 };
 
+/*
+ * What backs the pages of a region.
+ */
+#define VR_ANON     0       // zero-filled: heap, stack, anonymous mmap
+#define VR_ELF      1       // executable segment, file data then BSS
+#define VR_FILE     2       // mmap()ed file
+#define VR_GUARD    3       // reserved, every access faults
+#define VR_SHM      4       // shared memory object, see shm.h
+
+/*
+ * One region of an address space, [vr_base, vr_top), page aligned.
+ * Regions never overlap and are kept sorted by address, so the one an
+ * address falls in is found by binary search.
+ *
+ * Bytes [vr_filestart, vr_filestart + vr_filesize) of a VR_ELF or
+ * VR_FILE region are read from vr_vnode at vr_offset on first touch;
+ * anything else in the region starts out zero. Dirty pages of a
+ * MAP_SHARED file mapping are written back to the file by msync,
+ * munmap, exit and pageout; clean file pages are simply dropped under
+ * memory pressure. A VR_SHM region maps shared memory object vr_vnode
+ * the same way, but its pages are the object's own frames.
+ */
+struct vm_region {
+    vaddr_t vr_base;
+    vaddr_t vr_top;
+    unsigned vr_type;               // VR_*
+    unsigned vr_permission;         // AS_* bits
+    int vr_flags;                   // MAP_* flags if made by mmap, else 0
+    struct vnode *vr_vnode;
+    off_t vr_offset;                // file offset of vr_filestart
+    vaddr_t vr_filestart;
+    size_t vr_filesize;
+};
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(vm_region, ASINLINE);
+DEFARRAY(vm_region, ASINLINE);
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -86,28 +137,29 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        vaddr_t as_code_base;
-        vaddr_t as_code_top;
-        __u32 as_code_permission;
-        vaddr_t as_data_base;
-        vaddr_t as_data_top;
-        __u32 as_data_permission;
-        vaddr_t as_stack_base;
-        vaddr_t as_stack_top;
-        __u32 as_stack_permission;
-        vaddr_t as_heap_base;
-        vaddr_t as_heap_top;
-        __u32 as_heap_permission;
-        
-        __u32 as_kpages;
-        __u32 as_vpages;
+        struct vm_regionarray as_regions;   // sorted, changed under as_vm_lock
+        struct vm_region *as_heap;          // moved by sbrk
+        vaddr_t as_brk;                     // exact break, as_heap ends at the page after
+        unsigned as_committed;              // heap pages reserved with vm_commit
+        struct vm_region *as_stack;
         
-        __u32 as_kpagesreleased;
-        __u32 as_vpagesreleased;
+        // for getrusage: faults and swapping are counted under
+        // as_vm_lock, resident frames under coremap_lock
+        __u32 as_minflt;                    // faults served from RAM
+        __u32 as_majflt;                    // faults that read a file or the swap disk
+        __u32 as_tlbrefills;                // faults on pages mapped already
+        __u32 as_swapins;
+        __u32 as_swapouts;
+        __u32 as_rss;                       // frames mapped, not counting the zero frame
+        __u32 as_maxrss;
 
         pagedir_t as_pagedir[PAGE_SIZE / 4];
+        __u16 as_ptlive[NUM_PTE];           // entries in use in each page table
+        __u32 as_ptmap[NUM_PTE / 32];       // directory slots that have a table
         int as_refcount;
-        struct spinlock as_lock;
+        struct spinlock as_lock;        // page table entries, refcount
+        struct lock *as_vm_lock;        // serializes faults and sbrk, held across I/O
+        __u32 as_asid[MAXCPUS];         // per-cpu ASID and its generation, 0 if none
 #endif
 };
 
@@ -136,17 +188,47 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. The first FILESIZE bytes come from the file V
+ *                at OFFSET and are paged in on demand; the rest is
+ *                zero-filled.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Starts the heap after the last segment.
+ *
+ *    as_define_stack - set up the stack region in the address space,
+ *                with a guard region below it. (Normally called
+ *                *after* as_complete_load().) Hands back the initial
+ *                stack pointer for the new process.
+ *
+ *    as_grow_stack - extend the stack down to cover ADDR, moving the
+ *                guard gap along. Fails past the RLIMIT_STACK of the
+ *                current process or when the gap would hit another
+ *                region.
+ *
+ *    as_define_mmap - map LEN bytes of file V from OFFSET, or anonymous
+ *                memory if V is NULL. A shared memory object V gets a
+ *                VR_SHM region. *ADDR is the address to use with
+ *                MAP_FIXED, and otherwise gets a free range between the
+ *                heap limit and the stack.
  *
- *    as_define_stack - set up the stack region in the address space.
- *                (Normally called *after* as_complete_load().) Hands
- *                back the initial stack pointer for the new process.
+ *    as_remove_mmap - unmap the pages of the mmap()ed regions in
+ *                [START, END) and forget those parts of the regions.
+ *
+ *    as_find_region - the region ADDR falls in, or NULL.
+ *
+ *    as_page_is_text - tell whether page ADDR is part of a read-only
+ *                segment of the executable, which every process running
+ *                the program can share, and fill in KEY with what the
+ *                page holds.
+ *
+ *    as_page_is_shm - tell whether page ADDR maps a shared memory
+ *                object, and if so hand back the object and the page of
+ *                it in *V and *PAGE.
+ *
+ *    as_range_is_free - tell whether no region overlaps [START, END).
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -162,15 +244,33 @@ int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
                                    int readable,
                                    int writeable,
-                                   int executable);
+                                   int executable,
+                                   struct vnode *v,
+                                   off_t offset, size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_grow_stack(struct addrspace *as, vaddr_t addr);
 
 int               as_get_pt_entry(struct addrspace* as, vaddr_t addr, pagetable_t *pt_entry); 
+pagetable_t       as_peek_pt_entry(struct addrspace *as, vaddr_t addr);
+void              as_trim_pagetable(struct addrspace *as, vaddr_t addr);
 int               as_set_pt_entry(struct addrspace *as, vaddr_t addr, pagetable_t pt_entry);
 bool              as_is_valid_address(struct addrspace* as, vaddr_t addr);
+int               as_load_page(struct addrspace *as, vaddr_t addr, paddr_t paddr);
+bool              as_page_has_file_data(struct addrspace *as, vaddr_t addr);
+bool              as_page_is_text(struct addrspace *as, vaddr_t addr, struct textkey *key);
+bool              as_page_is_shm(struct addrspace *as, vaddr_t addr, struct vnode **v,
+                                 unsigned *page);
 unsigned          as_get_permission(struct addrspace *as, vaddr_t addr);
+int               as_store_page(struct addrspace *as, vaddr_t addr, paddr_t paddr);
+
+int               as_define_mmap(struct addrspace *as, vaddr_t *addr,
+                                 size_t len, unsigned permission, int flags,
+                                 struct vnode *v, off_t offset);
+int               as_remove_mmap(struct addrspace *as, vaddr_t start, vaddr_t end);
+struct vm_region *as_find_region(struct addrspace *as, vaddr_t addr);
+bool              as_range_is_free(struct addrspace *as, vaddr_t start, vaddr_t end);
 
 /*
  * Functions in loadelf.c
@@ -60,6 +60,8 @@
  * setsize - change size to NUM elements; may fail and return error.
  * add - append VAL to end of array; return its index in INDEX_RET if
  *       INDEX_RET isn't null; may fail and return error.
+ * insert - put VAL at INDEX, sliding that entry and the following ones
+ *       up; may fail and return error.
  * remove - excise entry INDEX and slide following entries down to
  *       close the resulting gap.
  *
@@ -82,6 +84,7 @@ ARRAYINLINE void array_set(const struct array *, unsigned index, void *val);
 int array_preallocate(struct array *, unsigned num);
 int array_setsize(struct array *, unsigned num);
 ARRAYINLINE int array_add(struct array *, void *val, unsigned *index_ret);
+int array_insert(struct array *, unsigned index, void *val);
 void array_remove(struct array *, unsigned index);
 
 /*
@@ -180,6 +183,7 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	INLINE int ARRAY##_preallocate(struct ARRAY *a, unsigned num);	\
 	INLINE int ARRAY##_setsize(struct ARRAY *a, unsigned num);	\
 	INLINE int ARRAY##_add(struct ARRAY *a, T *val, unsigned *index_ret); \
+	INLINE int ARRAY##_insert(struct ARRAY *a, unsigned index, T *val); \
 	INLINE void ARRAY##_remove(struct ARRAY *a, unsigned index)
 
 #define DEFARRAY_BYTYPE(ARRAY, T, INLINE) \
@@ -249,6 +253,12 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 		return array_add(&a->arr, (void *)val, index_ret); \
 	}							\
 								\
+	INLINE int						\
+	ARRAY##_insert(struct ARRAY *a, unsigned index, T *val) \
+	{							\
+		return array_insert(&a->arr, index, (void *)val); \
+	}							\
+								\
 	INLINE void						\
 	ARRAY##_remove(struct ARRAY *a, unsigned index)		\
 	{							\
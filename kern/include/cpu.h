@@ -46,6 +46,18 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/*
+ * Free page frames each cpu keeps for itself, and how many it moves
+ * to or from the coremap at once.
+ */
+#define CPU_FRAME_CACHE		16
+#define CPU_FRAME_BATCH		8
+
+/*
+ * Free page frames each cpu zeroes ahead of time when it is idle.
+ */
+#define CPU_ZERO_CACHE		16
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -61,6 +73,10 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_vm_faults;		/* TLB faults resolved by vm_fault */
+	unsigned c_vm_faultaround;	/* Extra entries preloaded by them */
+	uint32_t c_asid_cache;		/* Last ASID handed out, and generation */
+	struct addrspace *c_curas;	/* Address space whose ASID is loaded */
 
 	/*
 	 * Accessed by other cpus.
@@ -70,6 +86,20 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Used mostly by this cpu, but drained by any cpu that finds
+	 * the coremap empty.
+	 * Protected by c_frame_lock, taken after coremap_lock.
+	 */
+	struct spinlock c_frame_lock;
+	unsigned c_frames[CPU_FRAME_CACHE]; /* Free page frames (coremap idx) */
+	unsigned c_nframes;		/* Number of frames in c_frames */
+	unsigned c_frame_hits;		/* Frames allocated from c_frames */
+	unsigned c_frame_refills;	/* Batches taken from the coremap */
+	unsigned c_frame_drains;	/* Batches given back to the coremap */
+	unsigned c_zframes[CPU_ZERO_CACHE]; /* Free frames zeroed while idle */
+	unsigned c_nzframes;		/* Number of frames in c_zframes */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -87,6 +117,8 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_posted;	/* Shootdowns queued so far */
+	volatile unsigned c_shootdown_done; /* ...and handled so far */
 	struct spinlock c_ipi_lock;
 };
 
@@ -104,11 +136,14 @@ struct cpu {
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
  * for the cpu.
+ *
+ * cpu_get returns cpu number N, or NULL if there are fewer cpus.
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
+struct cpu *cpu_get(unsigned n);
 
 /*
  * Produce a string describing the CPU type.
@@ -67,6 +67,10 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+	__counter_t ru_ntlbrefill;	/* faults on mapped pages (count) */
+	__counter_t ru_nswapin;		/* pages read back from swap (count) */
+	__counter_t ru_nswapout;	/* pages paged out to swap (count) */
+	__size_t ru_rss;		/* current RSS, RUSAGE_SELF only (kb) */
 };
 
 /* limit codes for getrusage/setrusage */
@@ -0,0 +1,31 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/*
+ * Small LZ77 block compressor in the style of LZ4, fast enough to run
+ * on every page that is paged out. A block is a series of sequences,
+ * each a token byte (literal count in the high nibble, match length
+ * minus LZ_MIN_MATCH in the low one, 15 meaning more length bytes
+ * follow), the literals, and a 2-byte little-endian match offset. The
+ * last sequence has literals only.
+ *
+ * Functions:
+ *     lz_compress   - compress SRCLEN bytes of SRC into DST, using the
+ *                     LZ_WORKSIZE bytes at WORK as scratch. Returns
+ *                     the compressed size, or 0 if it would not fit
+ *                     in DSTMAX bytes.
+ *     lz_decompress - expand the SRCLEN bytes at SRC into exactly
+ *                     DSTLEN bytes at DST. Returns EINVAL if the block
+ *                     is corrupt or has a different size.
+ */
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    10
+#define LZ_WORKSIZE     ((1 << LZ_HASH_BITS) * sizeof(uint16_t))
+
+size_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstmax,
+                   void *work);
+int    lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+
+#endif /* _LZ_H_ */
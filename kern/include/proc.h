@@ -41,6 +41,8 @@
 #include <filetable.h>
 #include <array.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 
 struct addrspace;
 struct vnode;
@@ -68,6 +70,9 @@ struct proc {
 
 	/* add more material here as needed */
 	struct filetable *p_ft;
+	struct rlimit p_stack_limit;	/* RLIMIT_STACK, kept across exec */
+	struct rusage p_rusage;		/* of address spaces exec replaced */
+	struct rusage p_rusage_children; /* of children waited for */
 
 	/* process tracking */
 	pid_t pid;
@@ -117,5 +122,11 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Add the resource usage of a process, or of its children, to RU. */
+void proc_getrusage(struct proc *proc, int who, struct rusage *ru);
+
+/* Charge the usage of an exited child to the current process. */
+void proc_collectrusage(struct proc *child);
+
 
 #endif /* _PROC_H_ */
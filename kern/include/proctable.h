@@ -30,4 +30,7 @@ void proctable_assign_kern_pid(struct proc *proc);
 void proctable_unassign_pid(struct proc *proc);
 
 struct proc *proctable_get_proc(pid_t pid);
+
+// print the fault, swap and resident page counters of every process
+void proctable_print_rusage(void);
 #endif
\ No newline at end of file
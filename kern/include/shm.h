@@ -0,0 +1,37 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory objects. An object is a vnode of its own, so it is
+ * opened, closed, sized with ftruncate and mapped with mmap like a
+ * file, but its pages live only in RAM: every mapping of a page maps
+ * the same frame, in any number of address spaces and across fork.
+ * Named objects are kept in a table until shm_unlink; MAP_ANON |
+ * MAP_SHARED mappings get an unnamed one each. An object goes away
+ * with its last open file, mapping and name.
+ *
+ * Functions:
+ *     shm_bootstrap - set up the name table.
+ *     shm_open      - hand back a new reference to the object named
+ *                     NAME, creating it with O_CREAT. O_EXCL and
+ *                     O_TRUNC work as for open().
+ *     shm_unlink    - remove NAME from the table. Who has the object
+ *                     open or mapped keeps it.
+ *     shm_create    - make an unnamed object of LEN bytes.
+ *     shm_isobject  - tell whether V is a shared memory object.
+ *     shm_getpage   - the frame of page PAGE of object V, zero-filled
+ *                     on first touch, with one more reference for the
+ *                     caller to map. EFAULT past the end of the object.
+ */
+
+struct vnode;
+
+void shm_bootstrap(void);
+int  shm_open(const char *name, int flags, struct vnode **ret);
+int  shm_unlink(const char *name);
+int  shm_create(size_t len, struct vnode **ret);
+bool shm_isobject(struct vnode *v);
+int  shm_getpage(struct vnode *v, unsigned page, paddr_t *ret);
+
+
+#endif /* _SHM_H_ */
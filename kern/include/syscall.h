@@ -68,6 +68,7 @@ int sys_open(const userptr_t, int flags, int *retval);
 int sys_read(int fd, userptr_t buf, size_t buflen, ssize_t *retval);
 int sys_write(int fd, const userptr_t buf, size_t nbytes, ssize_t *retval);
 int sys_lseek(int fd, off_t pos, int whence, int32_t *retval, int32_t *retval1);
+int sys_ftruncate(int fd, off_t len);
 int sys_close(int fd, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_chdir(const userptr_t pathname, int *retval);
@@ -82,5 +83,18 @@ int sys_execv(const char *program, char **args, int *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t* retval);
 int sys__exit(int exitcode);
 int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+
+/*
+ * Memory-mapped file and shared memory system call declarations
+ */
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+int sys_shm_open(const_userptr_t name, int flags, mode_t mode, int *retval);
+int sys_shm_unlink(const_userptr_t name);
 
 #endif /* _SYSCALL_H_ */
@@ -157,6 +157,10 @@ int vfs_getcwd(struct uio *buf);
  *                    specified device.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_swapon    - Hand back the raw device RAWNAME (eg, "lhd1raw")
+ *                    for use as swap, unless a filesystem is mounted
+ *                    on it (EBUSY). It can't be mounted afterwards.
  */
 
 void vfs_bootstrap(void);
@@ -173,6 +177,7 @@ int vfs_mount(const char *devname, void *data,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
+int vfs_swapon(const char *rawname, struct vnode **result);
 
 /*
  * Array of vnodes.
@@ -40,36 +40,160 @@
 #include <machine/vm.h>
 
 struct pagetable;
+struct addrspace;
+struct rusage;
+struct textpage;
+struct vnode;
+
+/*
+ * Reverse map entry: one more (address space, virtual page) mapping a
+ * shared user frame.
+ */
+struct rmap_entry {
+    struct addrspace *rm_as;
+    vaddr_t rm_vaddr;
+    struct rmap_entry *rm_next;
+};
+
+/*
+ * One coremap entry per physical page managed by the VM.
+ * cm_entry packs the PP_* state bits below with the virtual page of
+ * the first owner; cm_refcount counts the page tables mapping the
+ * frame, which is more than one while it is shared copy-on-write after
+ * fork. cm_as is the address space of the first owner of a user page
+ * (NULL for kernel pages and the zero frame) and cm_rmap lists the
+ * other owners, so every mapping of a frame can be found from the
+ * frame. cm_busy is set while the frame is being paged out. A frame in
+ * the text page cache has PP_TEXT set, one more reference for the
+ * cache, and its cache entry in cm_text. A frame of a shared memory
+ * object has PP_SHM set and one more reference for the object, and is
+ * never paged out. A frame that same-page merging mapped in place of
+ * identical private pages has PP_KSM set while it can take more owners.
+ *
+ * Free frames are kept by a buddy allocator: the first frame of each
+ * free block of 2^cm_order frames is linked into the free list for
+ * that order through cm_next/cm_prev. Every other frame has cm_order
+ * BUDDY_NONE.
+ */
+struct coremap_entry {
+    uint32_t cm_entry;
+    uint16_t cm_refcount;
+    uint8_t cm_busy;
+    uint8_t cm_order;
+    struct addrspace *cm_as;
+    struct rmap_entry *cm_rmap;
+    struct textpage *cm_text;
+    unsigned cm_next;
+    unsigned cm_prev;
+};
+
+/*
+ * What a page of a read-only executable segment holds: TK_LEN bytes
+ * of file TK_VNODE from TK_OFFSET, TK_HEAD bytes into the page, and
+ * zeros around them. Pages with the same key share one frame.
+ */
+struct textkey {
+    struct vnode *tk_vnode;
+    off_t tk_offset;
+    unsigned tk_head;
+    unsigned tk_len;
+};
+
+/*
+ * One entry per swap slot. Slots in use are chained into a hash table
+ * keyed by (address space, virtual page), so finding a swapped page
+ * does not depend on the size of swap.
+ */
 struct swapentries {
-    paddr_t addr;
-    pid_t pid;
+    struct addrspace *as;   // owner of the swapped page
+    vaddr_t addr;           // user virtual page stored in this slot
+    unsigned next;          // next slot in the same hash chain
     bool in_use;
 };
 
+/*
+ * A raw disk used for swap. Its pages are slots sd_base up to
+ * sd_base + sd_nslots of the one slot space all devices share.
+ * sd_next is where the search for free slots on it picks up.
+ */
+struct swapdev {
+    struct vnode *sd_vnode;
+    const char *sd_name;
+    unsigned sd_base;
+    unsigned sd_nslots;
+    unsigned sd_next;       // under swapmap_lock
+};
+
+// set to 1 to page user memory out to the raw disks in SWAP_DEVICES
+#define SWAP                0
+
+// raw disks to swap to, separated by spaces. A disk with a filesystem
+// mounted is skipped, and a swap disk can't be mounted.
+#define SWAP_DEVICES        "lhd1raw:"
+
 // max physical RAM = 16MB
 #define RAM_MAX             (16 * 1024 * 1024)
 // 2M for now, maybe physical memory + swap size when swapping is implemented
 #define MAX_HEAP            (3 * 1024 * 1024)
-#define SWAP_SIZE           (2 * 1024 * 1024)
+
+// swap devices in use at most, each sized from its disk
+#define SWAP_MAX_DEVICES    4
+
+// the user stack starts out one page long and grows on demand up to the
+// process's RLIMIT_STACK, with a free gap of STACK_GUARD_GAP below it
+#define STACK_RLIMIT        (1024 * 1024)
+#define STACK_RLIMIT_MAX    (16 * 1024 * 1024)
+#define STACK_GUARD_GAP     (16 * PAGE_SIZE)
 
 // total number of ppages = 4096
 #define NUM_PPAGES          (RAM_MAX / PAGE_SIZE)
-#define NUM_SW_PAGES        (SWAP_SIZE / PAGE_SIZE)
 #define MIN_FREE_PAGES      8
 
-// 1 ppage entry uses 8 bytes, 1 page can control PAGE_SIZE / 8 = 512 entries
-#define PPAGE_ENTRIES       (PAGE_SIZE / 8)
+// the pageout thread wakes below PAGEOUT_LOW free frames and pages out
+// until PAGEOUT_HIGH are free
+#define PAGEOUT_LOW         32
+#define PAGEOUT_HIGH        64
+
+// most pages moved to or from swap by one request
+#define SWAP_CLUSTER        8
+
+// pages being paged out are compressed into a pool of at most
+// 1/ZSWAP_POOL_SHARE of the frames first, if they shrink to
+// ZSWAP_MAX_SIZE bytes or less
+#define ZSWAP_POOL_SHARE    4
+#define ZSWAP_MAX_SIZE      (PAGE_SIZE * 3 / 4)
+
+// a fault also loads the resident pages of the aligned block of
+// vm_faultaround pages around it into the TLB, 1 turns this off
+#define FAULT_AROUND        8
+#define FAULT_AROUND_MAX    16
+
+// buckets of the text page cache hash table, a power of 2
+#define TEXT_HASH_SIZE      256
+
+// named shared memory objects that may exist at once
+#define SHM_MAX_OBJECTS     32
+
+// buckets of the same-page merging tables, a power of 2
+#define KSM_HASH_SIZE       256
+
+// largest free block the frame allocator keeps is 2^BUDDY_MAX_ORDER pages
+#define BUDDY_MAX_ORDER     10
+#define BUDDY_NONE          0xFF
+#define NO_FRAME            0xFFFFFFFF
+
+// 1 ppage entry uses 20 bytes, 1 page can control PAGE_SIZE / 20 = 204 entries
+#define PPAGE_ENTRIES       (PAGE_SIZE / sizeof(struct coremap_entry))
+
+// number of pages to hold the coremap = 21
+#define NUM_COREMAP_PAGES   ((NUM_PPAGES + PPAGE_ENTRIES - 1) / PPAGE_ENTRIES)
 
-// number of pages to hold the coremap = 8
-#define NUM_COREMAP_PAGES   (NUM_PPAGES / PPAGE_ENTRIES)
 
 // 1 vpage entry uses 4 bytes, 1 page can control PAGE_SIZE / 4 = 1024 entries
 #define VPAGE_ENTRIES    (PAGE_SIZE / 4)
 
 #define PAGE_OFFSET_BITS    12
 
-// 6 bits, assume PID_MAX = 64
-#define PP_PID_MASK             0xFC0
 #define PP_USE_MASK             0x020
 #define PP_ALLOC_END_MASK       0x010
 #define PP_STATE_MASK           0x00C
@@ -78,6 +202,16 @@ struct swapentries {
 #define PP_USE                  0x020
 #define PP_ALLOC_END            0x010
 
+// in the text page cache, and looked up there since the clock hand passed
+#define PP_TEXT                 0x040
+#define PP_TEXT_USED            0x200
+
+// belongs to a shared memory object
+#define PP_SHM                  0x400
+
+// merged by same-page merging, mapped copy-on-write by every owner
+#define PP_KSM                  0x800
+
 #define PP_FREE                 0x000
 #define PP_DIRTY                0x004        
 #define PP_CLEAN                0x008
@@ -97,6 +231,9 @@ struct swapentries {
 #define CLEAR_PPAGE_USE(ppentry)    (*ppentry & ~PP_USE)
 
 #define IS_PPAGE_ALLOC_END(ppage)   (ppage & PP_ALLOC_END_MASK)
+#define IS_PPAGE_TEXT(ppage)        (ppage & PP_TEXT)
+#define IS_PPAGE_SHM(ppage)         (ppage & PP_SHM)
+#define IS_PPAGE_KSM(ppage)         (ppage & PP_KSM)
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -105,30 +242,66 @@ struct swapentries {
 
 #define NO_SWAP_IDX 0xFFFFFFFF
 
-#define SWAPIN_NOT_FOUND 1
-#define SWAPIN_NO_MEM 2
-
 /* Initialization function */
 void vm_bootstrap(void);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
+int vm_set_faultaround(unsigned npages);
+int vm_set_ksm(unsigned npages);
+void vm_getusage(struct addrspace *as, struct rusage *ru);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 int alloc_sbrk_pages(unsigned npages);
 int free_sbrk_pages(unsigned npages);
-int duplicate_pagetable(struct pagetable* from, struct pagetable *to);
+int vm_commit(unsigned npages);
+void vm_uncommit(unsigned npages);
+
+/* Unmap pages of AS and free what backs them; write back mapped files */
+void vm_unmap(struct addrspace *as, vaddr_t start, unsigned npages);
+int vm_msync(struct addrspace *as, vaddr_t start, vaddr_t end);
+unsigned duplicate_pagetable(struct addrspace *to_as, vaddr_t base,
+                             struct pagetable* from, struct pagetable *to,
+                             struct rmap_entry **pool);
+void free_user_page(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+int rmap_reserve(struct rmap_entry **pool, unsigned n);
+void rmap_release(struct rmap_entry *pool);
+
+/* Forget the cached text pages of V, after V was written to */
+void vm_textcache_purge(struct vnode *v);
+
+/* Frames of shared memory objects: get a zeroed one, add and drop references */
+paddr_t vm_shm_alloc(void);
+void vm_shm_ref(paddr_t paddr);
+void vm_shm_release(paddr_t paddr);
+
+/* ASIDs: make AS current on this cpu */
+uint32_t vm_activate(struct addrspace *as);
+
+/* Drop one page / all pages of AS from the TLB of every cpu, and wait */
+void vm_tlbshootdown_page(struct addrspace *as, vaddr_t vaddr);
+void vm_tlbflush_as(struct addrspace *as);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 void vm_tlbinvalidate(void);
 
-void remove_swap_entry(vaddr_t addr, pid_t pid);
-void swapout(void);
-int swapin(vaddr_t addr, pid_t pid);
+void remove_swap_entry(struct addrspace *as, vaddr_t addr);
+int swap_duplicate(struct addrspace *from, struct addrspace *to, vaddr_t addr);
+int swapout(void);
+int swapin(struct addrspace *as, vaddr_t addr, paddr_t *ret, bool *cached);
+
+/* Print allocator and lock contention counters. */
+void vm_printstats(void);
+
+/* Allocate a zero-filled kernel page; free it with free_kpages. */
+vaddr_t alloc_zeroed_kpage(void);
+
+/* Called by cpu_idle: zero one free frame ahead of time, if useful. */
+bool vm_idle_zero(void);
 
 
 #endif /* _VM_H_ */
@@ -0,0 +1,35 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap tier. Pages being paged out are compressed into a
+ * bounded pool of kernel frames first, and only go to the swap disks
+ * when they don't compress or the pool is full. The pool is indexed by
+ * swap slot: a page in the pool still owns its slot, whose blocks on
+ * disk are simply not written.
+ *
+ * Functions:
+ *     zswap_bootstrap  - set up the pool for NSLOTS swap slots, using
+ *                        at most MAXPAGES frames.
+ *     zswap_store      - compress PAGE into the pool as slot SLOT.
+ *                        Returns E2BIG if it does not compress well
+ *                        enough and ENOSPC if the pool is full.
+ *     zswap_load       - expand slot SLOT into PAGE. Returns ENOENT if
+ *                        the slot is not in the pool.
+ *     zswap_holds      - return whether slot SLOT is in the pool.
+ *     zswap_invalidate - drop slot SLOT from the pool, if it is there.
+ *     zswap_printstats - print pool usage and hit counters.
+ *
+ * The caller makes sure nobody stores, loads or drops a slot while
+ * somebody else does; the VM does it under the owner's as_vm_lock.
+ */
+
+void zswap_bootstrap(unsigned nslots, unsigned maxpages);
+int  zswap_store(unsigned slot, const void *page);
+int  zswap_load(unsigned slot, void *page);
+bool zswap_holds(unsigned slot);
+void zswap_invalidate(unsigned slot);
+void zswap_printstats(void);
+
+
+#endif /* _ZSWAP_H_ */
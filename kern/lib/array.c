@@ -121,6 +121,25 @@ array_setsize(struct array *a, unsigned num)
 	return 0;
 }
 
+int
+array_insert(struct array *a, unsigned index, void *val)
+{
+	unsigned num_to_move;
+	int result;
+
+	ARRAYASSERT(index <= a->num);
+
+	result = array_setsize(a, a->num + 1);
+	if (result) {
+		return result;
+	}
+
+	num_to_move = a->num - (index + 1);
+	memmove(a->v + index+1, a->v + index, num_to_move*sizeof(void *));
+	a->v[index] = val;
+	return 0;
+}
+
 void
 array_remove(struct array *a, unsigned index)
 {
@@ -0,0 +1,216 @@
+/*
+ * LZ77 block compression, see lz.h for the format.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <lz.h>
+
+// a length nibble of LZ_LEN_MORE is continued in the following bytes
+#define LZ_LEN_MORE     15
+
+static
+uint32_t
+lz_read32(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static
+unsigned
+lz_hash(uint32_t seq)
+{
+        return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Append one sequence: LITLEN literals from LIT and, unless MLEN is 0,
+ * a match of MLEN bytes OFFSET bytes back. Returns -1 if it does not
+ * fit before OEND.
+ */
+static
+int
+lz_emit(uint8_t **opp, uint8_t *oend, const uint8_t *lit, size_t litlen,
+        unsigned offset, size_t mlen)
+{
+        uint8_t *op = *opp;
+        uint8_t *token;
+        size_t len;
+
+        if (op >= oend) {
+                return -1;
+        }
+        token = op++;
+
+        len = litlen;
+        *token = (len < LZ_LEN_MORE ? len : LZ_LEN_MORE) << 4;
+        if (len >= LZ_LEN_MORE) {
+                for (len -= LZ_LEN_MORE; ; len -= 255) {
+                        if (op >= oend) {
+                                return -1;
+                        }
+                        *op++ = (len < 255) ? len : 255;
+                        if (len < 255) {
+                                break;
+                        }
+                }
+        }
+        if (litlen > (size_t) (oend - op)) {
+                return -1;
+        }
+        memcpy(op, lit, litlen);
+        op += litlen;
+
+        if (mlen > 0) {
+                if (oend - op < 2) {
+                        return -1;
+                }
+                *op++ = offset & 0xff;
+                *op++ = offset >> 8;
+
+                len = mlen - LZ_MIN_MATCH;
+                *token |= (len < LZ_LEN_MORE) ? len : LZ_LEN_MORE;
+                if (len >= LZ_LEN_MORE) {
+                        for (len -= LZ_LEN_MORE; ; len -= 255) {
+                                if (op >= oend) {
+                                        return -1;
+                                }
+                                *op++ = (len < 255) ? len : 255;
+                                if (len < 255) {
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        *opp = op;
+        return 0;
+}
+
+size_t
+lz_compress(const void *src, size_t srclen, void *dst, size_t dstmax,
+            void *work)
+{
+        const uint8_t *in = src;
+        const uint8_t *end = in + srclen;
+        const uint8_t *ip = in, *anchor = in, *cand;
+        uint8_t *op = dst;
+        uint16_t *table = work;
+        uint32_t seq;
+        unsigned h;
+        size_t mlen;
+
+        // positions are kept in 16 bits
+        KASSERT(srclen <= 0xffff);
+        bzero(table, LZ_WORKSIZE);
+
+        while (end - ip >= LZ_MIN_MATCH) {
+                seq = lz_read32(ip);
+                h = lz_hash(seq);
+                cand = in + table[h];
+                table[h] = ip - in;
+
+                if (cand >= ip || lz_read32(cand) != seq) {
+                        ip++;
+                        continue;
+                }
+
+                mlen = LZ_MIN_MATCH;
+                while (ip + mlen < end && cand[mlen] == ip[mlen]) {
+                        mlen++;
+                }
+                if (lz_emit(&op, (uint8_t *) dst + dstmax, anchor, ip - anchor,
+                            ip - cand, mlen)) {
+                        return 0;
+                }
+                ip += mlen;
+                anchor = ip;
+        }
+
+        // whatever is left goes out as literals
+        if (lz_emit(&op, (uint8_t *) dst + dstmax, anchor, end - anchor, 0, 0)) {
+                return 0;
+        }
+        return op - (uint8_t *) dst;
+}
+
+/*
+ * Read the rest of a length whose nibble was LZ_LEN_MORE.
+ */
+static
+int
+lz_getlen(const uint8_t **ipp, const uint8_t *iend, size_t *len)
+{
+        const uint8_t *ip = *ipp;
+        unsigned b;
+
+        do {
+                if (ip >= iend) {
+                        return EINVAL;
+                }
+                b = *ip++;
+                *len += b;
+        } while (b == 255);
+
+        *ipp = ip;
+        return 0;
+}
+
+int
+lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+        const uint8_t *ip = src;
+        const uint8_t *iend = ip + srclen;
+        uint8_t *op = dst;
+        uint8_t *oend = op + dstlen;
+        const uint8_t *match;
+        unsigned token, offset;
+        size_t len;
+
+        while (ip < iend) {
+                token = *ip++;
+
+                len = token >> 4;
+                if (len == LZ_LEN_MORE && lz_getlen(&ip, iend, &len)) {
+                        return EINVAL;
+                }
+                if (len > (size_t) (iend - ip) || len > (size_t) (oend - op)) {
+                        return EINVAL;
+                }
+                memcpy(op, ip, len);
+                ip += len;
+                op += len;
+
+                if (ip == iend) {
+                        // the last sequence
+                        break;
+                }
+
+                if (iend - ip < 2) {
+                        return EINVAL;
+                }
+                offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if (offset == 0 || offset > (size_t) (op - (uint8_t *) dst)) {
+                        return EINVAL;
+                }
+
+                len = token & LZ_LEN_MORE;
+                if (len == LZ_LEN_MORE && lz_getlen(&ip, iend, &len)) {
+                        return EINVAL;
+                }
+                len += LZ_MIN_MATCH;
+                if (len > (size_t) (oend - op)) {
+                        return EINVAL;
+                }
+
+                // byte by byte: a match may overlap what it produces
+                match = op - offset;
+                while (len-- > 0) {
+                        *op++ = *match++;
+                }
+        }
+
+        return (op == oend) ? 0 : EINVAL;
+}
@@ -37,6 +37,8 @@
 #include <clock.h>
 #include <thread.h>
 #include <proc.h>
+#include <proctable.h>
+#include <vm.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -410,6 +412,54 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proctable_print_rusage();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: faultaround npages\n");
+		return EINVAL;
+	}
+
+	return vm_set_faultaround(atoi(args[1]));
+}
+
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: ksm npages\n");
+		return EINVAL;
+	}
+
+	return vm_set_ksm(atoi(args[1]));
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -468,6 +518,7 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[lzt] LZ compression test          ",
 	"[tlt] Threadlist test               ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
@@ -516,6 +567,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM and frame lock stats    ",
+	"[vmps] Per-process VM stats         ",
+	"[faultaround] Set fault-around pages",
+	"[ksm] Merge identical pages         ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -570,10 +625,15 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstats },
+	{ "vmps",	cmd_vmps },
+	{ "faultaround", cmd_faultaround },
+	{ "ksm",	cmd_ksm },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "lzt",	lztest },
 	{ "tlt",	threadlisttest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
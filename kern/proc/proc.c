@@ -47,6 +47,7 @@
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <vnode.h>
 #include <proctable.h>
 #include <kern/wait.h>
@@ -80,6 +81,10 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_stack_limit.rlim_cur = STACK_RLIMIT;
+	proc->p_stack_limit.rlim_max = STACK_RLIMIT_MAX;
+	bzero(&proc->p_rusage, sizeof(proc->p_rusage));
+	bzero(&proc->p_rusage_children, sizeof(proc->p_rusage_children));
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -370,6 +375,7 @@ proc_create_sysfork(struct proc **p_new_forked_proc)
         as->as_refcount++;
         spinlock_release(&as->as_lock);
 	}
+	(*p_new_forked_proc)->p_stack_limit = curproc->p_stack_limit;
 
 	/* VFS fields */
 
@@ -500,6 +506,62 @@ proc_setas(struct addrspace *newas)
 	return oldas;
 }
 
+/*
+ * Add the counters of SRC to DST. The current RSS only makes sense
+ * for a live address space and is left alone.
+ */
+static
+void
+rusage_add(struct rusage *dst, const struct rusage *src)
+{
+	if (src->ru_maxrss > dst->ru_maxrss) {
+		dst->ru_maxrss = src->ru_maxrss;
+	}
+	dst->ru_minflt += src->ru_minflt;
+	dst->ru_majflt += src->ru_majflt;
+	dst->ru_ntlbrefill += src->ru_ntlbrefill;
+	dst->ru_nswapin += src->ru_nswapin;
+	dst->ru_nswapout += src->ru_nswapout;
+}
+
+/*
+ * Add the resource usage of PROC to RU: with RUSAGE_SELF that of its
+ * address space and the ones exec replaced, with RUSAGE_CHILDREN that
+ * of the children it waited for and theirs.
+ */
+void
+proc_getrusage(struct proc *proc, int who, struct rusage *ru)
+{
+	if (who == RUSAGE_CHILDREN) {
+		rusage_add(ru, &proc->p_rusage_children);
+		return;
+	}
+
+	/* p_lock keeps exec from destroying the address space meanwhile */
+	spinlock_acquire(&proc->p_lock);
+	rusage_add(ru, &proc->p_rusage);
+	if (proc->p_addrspace != NULL) {
+		vm_getusage(proc->p_addrspace, ru);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Charge the usage of CHILD, which has exited but still has its
+ * address space, to the current process. Called by waitpid before it
+ * lets the child go.
+ */
+void
+proc_collectrusage(struct proc *child)
+{
+	struct rusage ru;
+
+	bzero(&ru, sizeof(ru));
+	proc_getrusage(child, RUSAGE_SELF, &ru);
+	proc_getrusage(child, RUSAGE_CHILDREN, &ru);
+	rusage_add(&curproc->p_rusage_children, &ru);
+}
+
 
 void
 proc_exit(int exit_code, int w_origin) {
@@ -16,6 +16,7 @@
 #include <uio.h>
 #include <filetable.h>
 #include <synch.h>
+#include <vm.h>
 
 /*
  * open() system call implementation
@@ -190,6 +191,9 @@ sys_write(int fd, const userptr_t buf, size_t nbytes, ssize_t *retval)
     size_t nbytes_written = nbytes - u.uio_resid;
     curproc->p_ft->file_entries[fd]->offset += nbytes_written;
 
+    // programs started from now on have to see what was written
+    vm_textcache_purge(curproc->p_ft->file_entries[fd]->vn);
+
     lock_release(curproc->p_ft->file_entries[fd]->lk_file);
 
     *retval = nbytes_written;
@@ -277,6 +281,51 @@ sys_lseek(int fd, off_t pos, int whence, int32_t *retval, int32_t *retval1)
     return 0;
 }
 
+/*
+ * ftruncate() system call implementation
+ */
+int
+sys_ftruncate(int fd, off_t len)
+{
+    struct filetable *ft;
+    struct ft_file *f;
+    int result;
+
+    if (len < 0) {
+        return EINVAL;
+    }
+
+    // Check if fd is a valid one
+    if (fd < 0 || fd >= OPEN_MAX) {
+        return EBADF;
+    }
+
+    ft = curproc->p_ft;
+    lock_acquire(ft->lk_ft);
+    f = ft->file_entries[fd];
+    if (f == NULL) {
+        lock_release(ft->lk_ft);
+        return EBADF;
+    }
+    lock_release(ft->lk_ft);
+
+    // Only a file open for writing can change size
+    lock_acquire(f->lk_file);
+    if ((f->flags & O_ACCMODE) == O_RDONLY) {
+        lock_release(f->lk_file);
+        return EINVAL;
+    }
+    result = VOP_TRUNCATE(f->vn, len);
+    lock_release(f->lk_file);
+    if (result) {
+        return result;
+    }
+
+    // someone may be running the file we just changed
+    vm_textcache_purge(f->vn);
+    return 0;
+}
+
 /*
  * close() system call implementation
  */
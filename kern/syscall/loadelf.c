@@ -37,6 +37,11 @@
  *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
+ * With our VM the chunks are not loaded here: as_define_region
+ * records where each segment lives in the file and vm_fault reads
+ * the pages in as they are first touched. Only dumbvm still loads
+ * the whole program up front.
+ *
  * This gives the VM code enough flexibility to deal with even grossly
  * mis-linked executables if that proves desirable. Under normal
  * circumstances, as_prepare_load and as_complete_load probably don't
@@ -59,6 +64,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +80,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +151,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -247,7 +255,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+					  ph.p_flags & PF_X,
+					  v, ph.p_offset, ph.p_filesz);
 		if (result) {
 			return result;
 		}
@@ -258,6 +267,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +305,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* OPT_DUMBVM */
 
 	result = as_complete_load(as);
 	if (result) {
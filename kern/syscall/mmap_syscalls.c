@@ -0,0 +1,263 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <filetable.h>
+#include <syscall.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <shm.h>
+#include <copyinout.h>
+#include <limits.h>
+
+/*
+ * Map LEN bytes of the file open as FD, starting at OFFSET, into the
+ * current process, or LEN bytes of zero-filled memory with MAP_ANON.
+ * Nothing is read yet; vm_fault pages the file in on first touch.
+ * A shared memory object from shm_open can only be mapped MAP_SHARED;
+ * so is shared anonymous memory, which gets an object of its own that
+ * children forked later map too. Returns the address of the mapping.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, int32_t *retval)
+{
+    struct addrspace *as = proc_getas();
+    struct ft_file *file;
+    struct vnode *vn = NULL;
+    vaddr_t base = (vaddr_t) addr;
+    unsigned permission = 0;
+    int accmode;
+    int err;
+
+    *retval = -1;
+    if (len == 0 || (offset & ~(off_t)PAGE_FRAME) != 0 || offset < 0) {
+        return EINVAL;
+    }
+    if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+        (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE)) {
+        return EINVAL;
+    }
+
+    if (prot & PROT_READ) {
+        permission |= AS_READABLE;
+    }
+    if (prot & PROT_WRITE) {
+        permission |= AS_WRITEABLE;
+    }
+    if (prot & PROT_EXEC) {
+        permission |= AS_EXECUTABLE;
+    }
+
+    if (flags & MAP_ANON) {
+        if (flags & MAP_SHARED) {
+            err = shm_create(len, &vn);
+            if (err) {
+                return err;
+            }
+            offset = 0;
+        }
+        goto map;
+    }
+
+    if (fd < 0 || fd >= OPEN_MAX) {
+        return EBADF;
+    }
+    lock_acquire(curproc->p_ft->lk_ft);
+    file = curproc->p_ft->file_entries[fd];
+    if (file == NULL) {
+        lock_release(curproc->p_ft->lk_ft);
+        return EBADF;
+    }
+    vn = file->vn;
+    accmode = file->flags & O_ACCMODE;
+    // the mapping keeps the file alive after it is closed
+    VOP_INCREF(vn);
+    lock_release(curproc->p_ft->lk_ft);
+
+    // we read the file to fill pages in, and write it back only for
+    // a shared mapping that may be stored to
+    if (accmode == O_WRONLY ||
+        ((flags & MAP_SHARED) && (prot & PROT_WRITE) && accmode != O_RDWR)) {
+        VOP_DECREF(vn);
+        return EACCES;
+    }
+    // there is no file to read a private copy from
+    if (shm_isobject(vn) && !(flags & MAP_SHARED)) {
+        VOP_DECREF(vn);
+        return EINVAL;
+    }
+
+    err = VOP_MMAP(vn);
+    if (err) {
+        VOP_DECREF(vn);
+        return err;
+    }
+
+map:
+    lock_acquire(as->as_vm_lock);
+    err = as_define_mmap(as, &base, len, permission, flags, vn, offset);
+    lock_release(as->as_vm_lock);
+    if (vn != NULL) {
+        VOP_DECREF(vn);
+    }
+    if (err) {
+        return err;
+    }
+
+    *retval = (int32_t) base;
+    return 0;
+}
+
+/*
+ * Remove the file mappings in [ADDR, ADDR+LEN). Stores to shared
+ * mappings are written back first. Parts of the range that are not
+ * mapped are left alone.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+    struct addrspace *as = proc_getas();
+    vaddr_t start = (vaddr_t) addr;
+    vaddr_t end;
+    int err;
+
+    if ((start & ~PAGE_FRAME) != 0 || len == 0) {
+        return EINVAL;
+    }
+    end = start + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+    if (end < start || end > USERSPACETOP) {
+        return EINVAL;
+    }
+
+    lock_acquire(as->as_vm_lock);
+    err = vm_msync(as, start, end);
+    if (!err) {
+        err = as_remove_mmap(as, start, end);
+    }
+    lock_release(as->as_vm_lock);
+    return err;
+}
+
+/*
+ * Write the dirty pages of the shared file mappings in [ADDR, ADDR+LEN)
+ * back to their files. Every page in the range must be mapped.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+    struct addrspace *as = proc_getas();
+    vaddr_t start = (vaddr_t) addr;
+    vaddr_t end, vaddr;
+    int err;
+
+    if ((start & ~PAGE_FRAME) != 0 ||
+        (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC))) {
+        return EINVAL;
+    }
+    end = start + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+    if (end < start) {
+        return ENOMEM;
+    }
+
+    lock_acquire(as->as_vm_lock);
+    for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        if (as_find_region(as, vaddr) == NULL ||
+            as_find_region(as, vaddr)->vr_flags == 0) {
+            lock_release(as->as_vm_lock);
+            return ENOMEM;
+        }
+    }
+
+    // there is no write-behind, MS_ASYNC writes right away too
+    err = vm_msync(as, start, end);
+    lock_release(as->as_vm_lock);
+    return err;
+}
+
+/*
+ * Open the shared memory object NAME, creating it with O_CREAT, and
+ * return a file descriptor for it. It starts out empty; size it with
+ * ftruncate and map it with mmap. MODE is accepted and ignored, like
+ * for open().
+ */
+int
+sys_shm_open(const_userptr_t name, int flags, mode_t mode, int *retval)
+{
+    struct ft_file *f;
+    struct vnode *vn;
+    char *kname;
+    int fd;
+    int err;
+
+    (void)mode;
+    *retval = -1;
+    if ((flags & ~(O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC)) != 0 ||
+        (flags & O_ACCMODE) == O_WRONLY ||
+        ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDWR)) {
+        return EINVAL;
+    }
+
+    kname = kmalloc(NAME_MAX + 1);
+    if (kname == NULL) {
+        return ENOMEM;
+    }
+    err = copyinstr(name, kname, NAME_MAX + 1, NULL);
+    if (err) {
+        kfree(kname);
+        return err;
+    }
+    if (kname[0] == '\0') {
+        kfree(kname);
+        return ENOENT;
+    }
+
+    err = shm_open(kname, flags, &vn);
+    kfree(kname);
+    if (err) {
+        return err;
+    }
+
+    f = ft_file_create(vn, flags & O_ACCMODE);
+    if (f == NULL) {
+        VOP_DECREF(vn);
+        return ENOMEM;
+    }
+    err = add_ft_file(curproc->p_ft, f, &fd);
+    if (err) {
+        // closes the object again
+        ft_file_destroy(f);
+        return err;
+    }
+
+    *retval = fd;
+    return 0;
+}
+
+/*
+ * Remove the name NAME of a shared memory object. The object lives on
+ * until the last process that has it open or mapped lets it go.
+ */
+int
+sys_shm_unlink(const_userptr_t name)
+{
+    char *kname;
+    int err;
+
+    kname = kmalloc(NAME_MAX + 1);
+    if (kname == NULL) {
+        return ENOMEM;
+    }
+    err = copyinstr(name, kname, NAME_MAX + 1, NULL);
+    if (!err) {
+        err = shm_unlink(kname);
+    }
+    kfree(kname);
+    return err;
+}
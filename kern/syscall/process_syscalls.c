@@ -8,6 +8,7 @@
 #include <current.h>
 #include <mips/trapframe.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <thread.h>
 #include <proctable.h>
 #include <copyinout.h>
@@ -327,7 +328,13 @@ sys_execv(const char* program, char** args, pid_t* retval)
 		return result;
 	}
 
-	as_destroy(proc_getas());
+	/* The old image's usage stays with the process. */
+	as = proc_setas(NULL);
+	as_deactivate();
+	spinlock_acquire(&curproc->p_lock);
+	vm_getusage(as, &curproc->p_rusage);
+	spinlock_release(&curproc->p_lock);
+	as_destroy(as);
 
 	/* Create a new address space. */
 	as = as_create();
@@ -406,6 +413,9 @@ sys_waitpid(pid_t pid, userptr_t status, int options, pid_t* retval)
     }
     lock_release(child_proc->wait_lock);
 
+    // Its usage is ours now, its address space goes once it is let go
+    proc_collectrusage(child_proc);
+
     // After collecting the child's exit code, we can allow it to terminate
     lock_acquire(child_proc->exit_lock);
     cv_broadcast(child_proc->exit_signal, child_proc->exit_lock);
@@ -431,4 +441,55 @@ sys__exit(int exitcode)
     proc_exit(exitcode, __WEXITED);
     panic("Should not return");
     return 0;
-}
\ No newline at end of file
+}
+int
+sys_getrusage(int who, userptr_t usage)
+{
+    struct rusage ru;
+
+    if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+        return EINVAL;
+    }
+
+    // no CPU time or I/O accounting, just the VM counters
+    bzero(&ru, sizeof(ru));
+    proc_getrusage(curproc, who, &ru);
+    return copyout(&ru, usage, sizeof(struct rusage));
+}
+
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+    // the stack is the only limit we enforce
+    if (resource != RLIMIT_STACK) {
+        return EINVAL;
+    }
+    return copyout(&curproc->p_stack_limit, rlp, sizeof(struct rlimit));
+}
+
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+    struct rlimit rl;
+    int err;
+
+    if (resource != RLIMIT_STACK) {
+        return EINVAL;
+    }
+    err = copyin(rlp, &rl, sizeof(struct rlimit));
+    if (err) {
+        return err;
+    }
+    if (rl.rlim_cur > rl.rlim_max) {
+        return EINVAL;
+    }
+    // the hard limit can only be lowered
+    if (rl.rlim_max > curproc->p_stack_limit.rlim_max) {
+        return EPERM;
+    }
+
+    // a lower limit leaves an already larger stack as it is, it just
+    // can't grow any further
+    curproc->p_stack_limit = rl;
+    return 0;
+}
@@ -78,3 +78,28 @@ proctable_get_proc(pid_t pid)
 {
     return proctable->proc_entries[pid];
 }
+
+void
+proctable_print_rusage(void)
+{
+    struct proc *proc;
+    struct rusage ru;
+
+    kprintf("  pid   minflt   majflt  tlbrefill  swapin swapout  rss(kb) maxrss(kb)  name\n");
+
+    // a process leaves the table before it is destroyed
+    lock_acquire(proctable->lk_pt);
+    for (int i = PID_MIN; i <= PID_MAX; i++) {
+        proc = proctable->proc_entries[i];
+        if (proc == NULL) {
+            continue;
+        }
+        bzero(&ru, sizeof(ru));
+        proc_getrusage(proc, RUSAGE_SELF, &ru);
+        kprintf("%5d %8llu %8llu %10llu %7llu %7llu %8u %10u  %s\n", i,
+                ru.ru_minflt, ru.ru_majflt, ru.ru_ntlbrefill,
+                ru.ru_nswapin, ru.ru_nswapout, ru.ru_rss, ru.ru_maxrss,
+                proc->p_name);
+    }
+    lock_release(proctable->lk_pt);
+}
@@ -9,65 +9,50 @@
 #include <synch.h>
 #include <vm.h>
 
-extern unsigned nfreepages;
-// extern struct lock *global_lock;
-extern struct spinlock sbrk_lock;
-
 int sys_sbrk(intptr_t amount, int32_t *retval)
 {
-    int err;
+    int err = 0;
     *retval = -1;
-    if (amount % PAGE_SIZE) {
-        return EINVAL;
-    }
 
-    spinlock_acquire(&sbrk_lock);
     struct addrspace *as = proc_getas();
-    vaddr_t heap_top = as->as_heap_top;
-    vaddr_t new_top = heap_top + amount;
-    
-    if (new_top >= as->as_stack_top) {
-        spinlock_release(&sbrk_lock);
-        return EINVAL;
-    }
+    lock_acquire(as->as_vm_lock);
+    struct vm_region *heap = as->as_heap;
+    vaddr_t brk = as->as_brk;
+    vaddr_t new_brk = brk + amount;
     
-    if (new_top < as->as_heap_base) {
-        spinlock_release(&sbrk_lock);
+    if ((amount < 0 && new_brk > brk) || new_brk < heap->vr_base) {
+        lock_release(as->as_vm_lock);
         return EINVAL;
     }
     
-    if (new_top > as->as_stack_base) {
-        spinlock_release(&sbrk_lock);
-        return ENOMEM;
-    }
-    
-    if ((amount > 0) && ((new_top - as->as_heap_base) > MAX_HEAP)) {
-        spinlock_release(&sbrk_lock);
+    // the break moves by the byte, the heap region by the page
+    vaddr_t heap_top = heap->vr_top;
+    vaddr_t new_top = ROUNDUP(new_brk, PAGE_SIZE);
+
+    // the heap may not run into the next region
+    if ((amount > 0) && (new_brk < brk || new_top < new_brk ||
+                         (new_top - heap->vr_base) > MAX_HEAP ||
+                         (new_top > heap_top && !as_range_is_free(as, heap_top, new_top)))) {
+        lock_release(as->as_vm_lock);
         return ENOMEM;
     }
     
-    if (amount == 0) {
-        *retval = (int32_t) heap_top;
-        spinlock_release(&sbrk_lock);
-        return 0;
-    }
-    
-    // the following vm functions are executed under a global lock
-    if (amount > 0) {
-        err = alloc_sbrk_pages(amount / PAGE_SIZE);
+    // the following vm functions are executed under the address space lock
+    if (new_top > heap_top) {
+        err = alloc_sbrk_pages((new_top - heap_top) / PAGE_SIZE);
     }
-    else {
-        err = free_sbrk_pages(-amount / PAGE_SIZE);
+    else if (new_top < heap_top) {
+        err = free_sbrk_pages((heap_top - new_top) / PAGE_SIZE);
     }
     
     if (err) {
-        spinlock_release(&sbrk_lock);
+        lock_release(as->as_vm_lock);
         return err;
     }
     
-    // kprintf("sbrk pages %d, heap %d, nfree %d\n", (int) amount, heap_top, nfreepages);
-    // return the old heap top
-    *retval = (int32_t) heap_top;
-    spinlock_release(&sbrk_lock);
+    // return the old break
+    as->as_brk = new_brk;
+    *retval = (int32_t) brk;
+    lock_release(as->as_vm_lock);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,79 @@
+/*
+ * Test code for the LZ block compressor.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <lz.h>
+#include <test.h>
+
+#define TESTSIZE 4096
+#define NPATTERNS 5
+
+static
+void
+fill(unsigned char *buf, unsigned pattern)
+{
+	unsigned i;
+
+	for (i=0; i<TESTSIZE; i++) {
+		switch (pattern) {
+		    case 0: buf[i] = 0; break;
+		    case 1: buf[i] = random(); break;
+		    case 2: buf[i] = "abcabcabd"[i % 9]; break;
+		    case 3: buf[i] = (random() % 4 == 0) ? i % 13 : 0; break;
+		    default:
+			buf[i] = (i < 20 || random() % 10 == 0) ? random() : buf[i-17];
+			break;
+		}
+	}
+}
+
+int
+lztest(int nargs, char **args)
+{
+	unsigned char *src, *dst, *back, *work;
+	size_t len;
+	unsigned i, j;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting lz test...\n");
+
+	src = kmalloc(TESTSIZE);
+	back = kmalloc(TESTSIZE);
+	dst = kmalloc(2 * TESTSIZE);
+	work = kmalloc(LZ_WORKSIZE);
+	KASSERT(src != NULL && back != NULL && dst != NULL && work != NULL);
+
+	for (i=0; i<NPATTERNS; i++) {
+		fill(src, i);
+
+		len = lz_compress(src, TESTSIZE, dst, 2 * TESTSIZE, work);
+		KASSERT(len > 0);
+		kprintf("pattern %u: %u bytes -> %u\n", i, TESTSIZE, len);
+
+		bzero(back, TESTSIZE);
+		KASSERT(lz_decompress(dst, len, back, TESTSIZE) == 0);
+		for (j=0; j<TESTSIZE; j++) {
+			KASSERT(src[j] == back[j]);
+		}
+
+		// a block of a different size is refused
+		KASSERT(lz_decompress(dst, len, back, TESTSIZE - 1) != 0);
+
+		// a block that does not fit is not written
+		if (len > 1) {
+			KASSERT(lz_compress(src, TESTSIZE, dst, len - 1, work) == 0);
+		}
+	}
+
+	kfree(work);
+	kfree(dst);
+	kfree(back);
+	kfree(src);
+
+	kprintf("LZ test complete\n");
+	return 0;
+}
@@ -52,6 +52,8 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
 }
 
 /*
@@ -75,6 +77,7 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	bool contended = false;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -102,9 +105,11 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		break;
@@ -112,6 +117,12 @@ spinlock_acquire(struct spinlock *splk)
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+
+	/* statistics; we hold the lock, so no atomics needed */
+	splk->splk_acquires++;
+	if (contended) {
+		splk->splk_contended++;
+	}
 }
 
 /*
@@ -225,6 +225,23 @@ lock_do_i_hold(struct lock *lock)
         return (curthread == lock->lock_holder);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool acquired = false;
+
+        KASSERT(lock != NULL);
+
+        spinlock_acquire(&lock->lock_spinlock);
+        if (lock->lock_holder == NULL) {
+                lock->lock_holder = curthread;
+                acquired = true;
+        }
+        spinlock_release(&lock->lock_spinlock);
+
+        return acquired;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
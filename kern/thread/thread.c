@@ -40,6 +40,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -187,6 +188,16 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	spinlock_init(&c->c_frame_lock);
+	c->c_nframes = 0;
+	c->c_frame_hits = 0;
+	c->c_frame_refills = 0;
+	c->c_frame_drains = 0;
+	c->c_nzframes = 0;
+	c->c_vm_faults = 0;
+	c->c_vm_faultaround = 0;
+	c->c_asid_cache = 0;
+	c->c_curas = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -194,6 +205,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_posted = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -1198,6 +1211,18 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Look up a cpu by number.
+ */
+struct cpu *
+cpu_get(unsigned n)
+{
+	if (n >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, n);
+}
+
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
@@ -1206,16 +1231,20 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_MAX || n == TLBSHOOTDOWN_ALL) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	target->c_shootdown_posted++;
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/* One interrupt serves everything queued before it is taken. */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
 }
@@ -1262,6 +1291,9 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		/* let the senders know (see vm_tlbshootdown_page) */
+		membar_store_store();
+		curcpu->c_shootdown_done = curcpu->c_shootdown_posted;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -60,6 +60,9 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem.
  *
+ * kd_swap    - Set once the raw device is given to the VM for swap;
+ *              it can't be mounted from then on.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +83,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	bool kd_swap;
 };
 
 DECLARRAY(knowndev, static __UNUSED inline);
@@ -407,6 +411,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_swap = false;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -523,7 +528,7 @@ vfs_mount(const char *devname, void *data,
 		return result;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_swap) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -548,6 +553,41 @@ vfs_mount(const char *devname, void *data,
 	return 0;
 }
 
+/*
+ * Hand the raw device RAWNAME (eg, "lhd1raw") to the VM for swap. A
+ * device with a filesystem mounted is refused, and one given to swap
+ * can't be mounted afterwards.
+ */
+int
+vfs_swapon(const char *rawname, struct vnode **result)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_rawname == NULL || strcmp(kd->kd_rawname, rawname)) {
+			continue;
+		}
+		if (kd->kd_fs != NULL || kd->kd_swap) {
+			vfs_biglock_release();
+			return EBUSY;
+		}
+		KASSERT(kd->kd_device != NULL);
+		kd->kd_swap = true;
+		VOP_INCREF(kd->kd_vnode);
+		*result = kd->kd_vnode;
+		vfs_biglock_release();
+		return 0;
+	}
+
+	vfs_biglock_release();
+	return ENODEV;
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -27,14 +27,21 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <current.h>
 #include <proc.h>
 #include <synch.h>
+#include <uio.h>
+#include <stat.h>
+#include <vnode.h>
+#include <shm.h>
 
 // number of entries in a pagetable, PAGE_SIZE / 4
 #define NUM_PTE             1024
@@ -48,17 +55,141 @@
 // page frame number mask
 #define PFN_MASK            0x3FF
 
-extern struct lock *global_lock;
 extern struct spinlock coremap_lock;
 
 static
 struct pagetable*
 create_pagetable()
 {
-    struct pagetable *new_pt = kmalloc(PAGE_SIZE);
-    if (new_pt) 
-        bzero(new_pt, PAGE_SIZE);
-    return new_pt;
+    // freed with free_kpages by pagetable_remove and as_destroy
+    return (struct pagetable *) alloc_zeroed_kpage();
+}
+
+/*
+ * Hook page table PT into slot PD_IDX of the page directory of AS,
+ * with LIVE entries in use.
+ */
+static
+void
+pagetable_install(struct addrspace *as, unsigned pd_idx, struct pagetable *pt,
+                  unsigned live)
+{
+    as->as_pagedir[pd_idx] = (pagedir_t) ((vaddr_t) pt & PAGE_FRAME);
+    as->as_ptlive[pd_idx] = live;
+    as->as_ptmap[pd_idx / 32] |= (1U << (pd_idx % 32));
+}
+
+/*
+ * Unhook the page table in slot PD_IDX of AS and free it.
+ */
+static
+void
+pagetable_remove(struct addrspace *as, unsigned pd_idx)
+{
+    struct pagetable *pt = (struct pagetable *) (as->as_pagedir[pd_idx] & PAGE_FRAME);
+
+    as->as_pagedir[pd_idx] = 0;
+    as->as_ptlive[pd_idx] = 0;
+    as->as_ptmap[pd_idx / 32] &= ~(1U << (pd_idx % 32));
+    free_kpages((vaddr_t) pt);
+}
+
+/*
+ * The first slot from PD_IDX on that has a page table, or NUM_PTE.
+ * Skips empty words of the bitmap, so a sparse directory is cheap to
+ * walk.
+ */
+static
+unsigned
+pagetable_next(struct addrspace *as, unsigned pd_idx)
+{
+    __u32 word;
+
+    while (pd_idx < NUM_PTE) {
+        word = as->as_ptmap[pd_idx / 32] >> (pd_idx % 32);
+        if (word == 0) {
+            pd_idx = (pd_idx / 32 + 1) * 32;
+            continue;
+        }
+        while (!(word & 1)) {
+            word >>= 1;
+            pd_idx++;
+        }
+        return pd_idx;
+    }
+    return NUM_PTE;
+}
+
+/*
+ * Allocate a region [BASE, TOP) of type TYPE with nothing behind it.
+ */
+static
+struct vm_region *
+region_create(vaddr_t base, vaddr_t top, unsigned type, unsigned permission)
+{
+    struct vm_region *r;
+
+    r = kmalloc(sizeof(struct vm_region));
+    if (r == NULL) {
+        return NULL;
+    }
+    bzero(r, sizeof(struct vm_region));
+    r->vr_base = base;
+    r->vr_top = top;
+    r->vr_type = type;
+    r->vr_permission = permission;
+    return r;
+}
+
+static
+void
+region_destroy(struct vm_region *r)
+{
+    if (r->vr_vnode != NULL) {
+        VOP_DECREF(r->vr_vnode);
+    }
+    kfree(r);
+}
+
+/*
+ * Index of the first region of AS that ends above ADDR, or the number
+ * of regions if there is none. Binary search, the regions are sorted
+ * and don't overlap.
+ */
+static
+unsigned
+region_index(struct addrspace *as, vaddr_t addr)
+{
+    unsigned lo = 0;
+    unsigned hi = vm_regionarray_num(&as->as_regions);
+    unsigned mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (vm_regionarray_get(&as->as_regions, mid)->vr_top <= addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Add region R to AS in address order. Fails if it overlaps another.
+ */
+static
+int
+region_insert(struct addrspace *as, struct vm_region *r)
+{
+    unsigned idx = region_index(as, r->vr_base);
+
+    if (idx < vm_regionarray_num(&as->as_regions) &&
+        vm_regionarray_get(&as->as_regions, idx)->vr_base < r->vr_top) {
+        return EINVAL;
+    }
+    return vm_regionarray_insert(&as->as_regions, idx, r);
 }
 
 /*
@@ -80,20 +211,22 @@ as_create(void)
 	bzero(as, sizeof(struct addrspace));
 
     spinlock_init(&as->as_lock);
+    as->as_vm_lock = lock_create("as_vm_lock");
+    if (as->as_vm_lock == NULL) {
+        kfree(as);
+        return NULL;
+    }
 
 	/*
 	 * Initialize as needed.
 	 */
-    as->as_stack_top = USERSTACK;
-	as->as_stack_base = USERSTACK - STACK_SIZE;
+    // regions come from load_elf, as_define_stack and mmap
+    vm_regionarray_init(&as->as_regions);
 	
-	as->as_stack_permission = AS_READABLE | AS_WRITEABLE;
-	as->as_heap_permission = AS_READABLE| AS_WRITEABLE;
-	as->as_code_permission = AS_READABLE | AS_WRITEABLE;
-	as->as_data_permission = AS_READABLE | AS_WRITEABLE;
-	
-	as->as_kpages = as->as_vpages = 0;
-	as->as_kpagesreleased = as->as_vpagesreleased = 0;
+	as->as_minflt = as->as_majflt = as->as_tlbrefills = 0;
+	as->as_swapins = as->as_swapouts = 0;
+	as->as_rss = as->as_maxrss = 0;
+	bzero(as->as_asid, sizeof(as->as_asid));
 
 	return as;
 }
@@ -102,72 +235,190 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	int err = 0;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
-	bool acquired = spinlock_do_i_hold(&coremap_lock);
-    if (!acquired)
-        spinlock_acquire(&coremap_lock);
-
-	newas->as_code_base = old->as_code_base;
-	newas->as_code_top = old->as_code_top;	
-	newas->as_data_base = old->as_data_base;
-	newas->as_data_top = old->as_data_top;	
-	newas->as_stack_base = old->as_stack_base;
-	newas->as_stack_top = old->as_stack_top;	
-	newas->as_heap_base = old->as_heap_base;
-	newas->as_heap_top = old->as_heap_top;	
 	
-    int i;
+    unsigned i, n, nlive;
+    struct rmap_entry *pool = NULL;
     struct pagetable* oldpt;
     struct pagetable* newpt;
+    struct vm_region *r, *copy;
+
+    // keep faults on the parent away while its pages become shared
+    lock_acquire(old->as_vm_lock);
+
+    for (n = 0; n < vm_regionarray_num(&old->as_regions) && !err; n++) {
+        r = vm_regionarray_get(&old->as_regions, n);
+
+        // shared file pages start out clean in both copies, so only
+        // the one that stores to a page writes it back
+        if (r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED)) {
+            err = vm_msync(old, r->vr_base, r->vr_top);
+            if (err) {
+                break;
+            }
+        }
+
+        copy = kmalloc(sizeof(struct vm_region));
+        if (copy == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        *copy = *r;
+        if (copy->vr_vnode != NULL) {
+            VOP_INCREF(copy->vr_vnode);
+        }
+        err = vm_regionarray_add(&newas->as_regions, copy, NULL);
+        if (err) {
+            region_destroy(copy);
+            break;
+        }
+        if (r == old->as_heap) {
+            newas->as_heap = copy;
+        }
+        if (r == old->as_stack) {
+            newas->as_stack = copy;
+        }
+    }
+
+    // the child may touch every heap page the parent may
+    newas->as_brk = old->as_brk;
+    if (!err) {
+        err = vm_commit(old->as_committed);
+        if (!err) {
+            newas->as_committed = old->as_committed;
+        }
+    }
 
-    for (i=0; i<NUM_PTE; i++) {
+    // the child becomes another owner of every resident page, which
+    // takes a reverse map entry each; the live counts are enough
+    nlive = 0;
+    for (i = pagetable_next(old, 0); i < NUM_PTE; i = pagetable_next(old, i + 1)) {
+        nlive += old->as_ptlive[i];
+    }
+    if (!err) {
+        err = rmap_reserve(&pool, nlive);
+    }
+
+    // only the tables the parent has in use need a look
+    spinlock_acquire(&old->as_lock);
+    spinlock_acquire(&coremap_lock);
+    for (i = pagetable_next(old, 0); i < NUM_PTE && !err; i = pagetable_next(old, i + 1)) {
+        if (old->as_ptlive[i] == 0) {
+            continue;
+        }
         oldpt = (struct pagetable *) (old->as_pagedir[i] & PAGE_FRAME);
-        if (oldpt != NULL) {
-            newpt = create_pagetable();
-            if (newpt == NULL) {
-                as_destroy(newas);
-                return ENOMEM;
+        newpt = create_pagetable();
+        if (newpt == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        // share the physical pages copy-on-write
+        pagetable_install(newas, i, newpt,
+                          duplicate_pagetable(newas, i << (PFN_BITS + PAGE_OFFSET_BITS),
+                                              oldpt, newpt, &pool));
+    }
+    spinlock_release(&coremap_lock);
+    spinlock_release(&old->as_lock);
+    rmap_release(pool);
+
+#if SWAP
+    // pages out in swap can't be shared, the child gets its own slot
+    for (i = pagetable_next(old, 0); i < NUM_PTE && !err; i = pagetable_next(old, i + 1)) {
+        if (old->as_ptlive[i] == 0) {
+            continue;
+        }
+        oldpt = (struct pagetable *) (old->as_pagedir[i] & PAGE_FRAME);
+        newpt = (struct pagetable *) (newas->as_pagedir[i] & PAGE_FRAME);
+        for (int j=0; j<NUM_PTE; j++) {
+            if (oldpt->pt_entries[j] != PT_VALID_MASK) {
+                continue;
             }
-            // add the new table to new page directory
-            newas->as_pagedir[i] = (pagedir_t) ((vaddr_t) newpt & PAGE_FRAME);
-            
-            // allocate physical pages for the new page table, and copy the memory contents over
-            duplicate_pagetable(oldpt, newpt);
+            vaddr_t vaddr = (i << (PFN_BITS + PAGE_OFFSET_BITS)) | (j << PAGE_OFFSET_BITS);
+            err = swap_duplicate(old, newas, vaddr);
+            if (err) {
+                break;
+            }
+            newpt->pt_entries[j] = PT_VALID_MASK;
+            newas->as_ptlive[i]++;
         }
     }
+#endif
 
-	*ret = newas;
-    if (!acquired)
-        spinlock_release(&coremap_lock);
-	return 0;
+    if (err) {
+        as_destroy(newas);
+    }
+    else {
+        *ret = newas;
+    }
+    lock_release(old->as_vm_lock);
+
+    // the TLB may still let the parent write to the pages we just shared
+    vm_tlbflush_as(old);
+	return err;
 }
 
 void
 as_destroy(struct addrspace *as)
 {
     struct pagetable *pt;
-    paddr_t ppage;
-    int i, j;
-    for (i=0; i<NUM_PTE; i++) {
+    struct vm_region *r;
+    pagetable_t pte;
+    unsigned n, i, live;
+    int j;
+
+    // wait out a pageout that is writing one of our pages
+    lock_acquire(as->as_vm_lock);
+
+    // stores to shared file mappings outlive the process
+    for (n = 0; n < vm_regionarray_num(&as->as_regions); n++) {
+        r = vm_regionarray_get(&as->as_regions, n);
+        if (r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED) &&
+            vm_msync(as, r->vr_base, r->vr_top)) {
+            kprintf("as_destroy: lost stores to a mapped file\n");
+        }
+    }
+
+    // visit only the tables in use, and in each only up to its last
+    // live entry
+    for (i = pagetable_next(as, 0); i < NUM_PTE; i = pagetable_next(as, i + 1)) {
         pt = (struct pagetable *) (as->as_pagedir[i] & PAGE_FRAME);  
-        as->as_pagedir[i] = 0;          
-        if (pt != NULL) {
-            for (j=0; j<NUM_PTE; j++) {
-                ppage = (paddr_t) (pt->pt_entries[j] & PAGE_FRAME);
-                if (ppage > 0) {
-                    // we store in paddr_t, but free_kpages is expecting vaddr_t
-                    free_kpages(PADDR_TO_KVADDR(ppage));
-                }
+        live = as->as_ptlive[i];
+        for (j=0; j<NUM_PTE && live > 0; j++) {
+            pte = pt->pt_entries[j];
+            if (pte == 0) {
+                continue;
+            }
+            live--;
+            if (pte & PT_PRESENT_MASK) {
+                // the frame may still be shared with a forked process
+                free_user_page(pte & PAGE_FRAME, as,
+                               (i << (PFN_BITS + PAGE_OFFSET_BITS)) | (j << PAGE_OFFSET_BITS));
+            }
+#if SWAP
+            // in swap, or still cached there
+            if (!(pte & PT_PRESENT_MASK) || (pte & PT_SWAPCACHE_MASK)) {
+                remove_swap_entry(as, (i << (PFN_BITS + PAGE_OFFSET_BITS)) | (j << PAGE_OFFSET_BITS));
             }
-            
-            kfree(pt);
+#endif
         }
+        pagetable_remove(as, i);
+    }
+    lock_release(as->as_vm_lock);
+
+    for (n = 0; n < vm_regionarray_num(&as->as_regions); n++) {
+        region_destroy(vm_regionarray_get(&as->as_regions, n));
     }
+    vm_regionarray_setsize(&as->as_regions, 0);
+    vm_regionarray_cleanup(&as->as_regions);
+    vm_uncommit(as->as_committed);
 
+    lock_destroy(as->as_vm_lock);
+    spinlock_cleanup(&as->as_lock);
 	kfree(as);
 }
 
@@ -185,7 +436,8 @@ as_activate(void)
 		return;
 	}
 
-    vm_tlbinvalidate();
+    // our TLB entries may still be there, tagged with our ASID
+    vm_activate(as);
 }
 
 void
@@ -204,16 +456,23 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Any
+ * number of segments can be defined, as long as no two of them share
+ * a page.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+		 int readable, int writeable, int executable,
+		 struct vnode *v, off_t offset, size_t filesize)
 {
-    size_t npages;
-    __u32 permission = (readable | writeable | executable) << 8;
+    struct vm_region *r;
+    vaddr_t filestart = vaddr;
+    int result;
+
+	if (filesize > sz) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = sz;
+	}
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -222,35 +481,27 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = sz / PAGE_SIZE;
-    
-	if (as->as_code_base == 0) {
-	    as->as_code_base = vaddr;
-	    as->as_code_top = vaddr + npages * PAGE_SIZE;
-	    as->as_code_permission |= permission; 
+    // the ELF PF_* bits are the same as our AS_* bits
+    r = region_create(vaddr, vaddr + sz, VR_ELF, readable | writeable | executable);
+    if (r == NULL) {
+        return ENOMEM;
+    }
 
-	    as->as_heap_base = as->as_heap_top = as->as_code_top;
-	}
-	else {
-	    if (vaddr >= as->as_code_top) {
-	        as->as_data_base = vaddr;
-	        as->as_data_top = vaddr + npages * PAGE_SIZE;
-	        as->as_data_permission |= permission;
-	        as->as_heap_base = as->as_heap_top = as->as_data_top;
-	    }
-	    else {
-	        // the data segment was loaded before text segment
-	        as->as_data_base = as->as_code_base;
-	        as->as_data_top = as->as_code_top;
-	        as->as_data_permission = as->as_code_permission;
-	        
-	        as->as_code_base = vaddr;
-	        as->as_code_top = vaddr + npages * PAGE_SIZE;
-	        as->as_code_permission |= permission;
-	        
-	        as->as_heap_base = as->as_heap_top = as->as_data_top;
-	    }
-	}
+    // remember where the contents are, vm_fault reads them on first touch
+    if (v != NULL && filesize > 0) {
+        VOP_INCREF(v);
+        r->vr_vnode = v;
+        r->vr_offset = offset;
+        r->vr_filestart = filestart;
+        r->vr_filesize = filesize;
+    }
+
+    result = region_insert(as, r);
+    if (result) {
+        kprintf("ELF: segments at 0x%x overlap\n", vaddr);
+        region_destroy(r);
+        return (result == EINVAL) ? ENOEXEC : result;
+    }
 	return 0;
 }
 
@@ -265,16 +516,79 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-    as->as_code_permission >>= 8;
-    as->as_data_permission >>= 8;
+    unsigned n = vm_regionarray_num(&as->as_regions);
+    vaddr_t base = 0;
+    int result;
+
+    // the heap starts out empty right after the last segment
+    if (n > 0) {
+        base = vm_regionarray_get(&as->as_regions, n - 1)->vr_top;
+    }
+    as->as_heap = region_create(base, base, VR_ANON, AS_READABLE | AS_WRITEABLE);
+    if (as->as_heap == NULL) {
+        return ENOMEM;
+    }
+    as->as_brk = base;
+    result = region_insert(as, as->as_heap);
+    if (result) {
+        region_destroy(as->as_heap);
+        as->as_heap = NULL;
+        return result;
+    }
 	return 0;
 }
 
+/*
+ * Lowest address the stack of AS may grow down to under the current
+ * process's RLIMIT_STACK. The hard cap keeps room for the heap and
+ * mmap below it whatever the limit says.
+ */
+static
+vaddr_t
+stack_floor(struct addrspace *as)
+{
+    rlim_t limit = STACK_RLIMIT;
+
+    if (curproc != NULL) {
+        limit = curproc->p_stack_limit.rlim_cur;
+    }
+    if (limit > STACK_RLIMIT_MAX) {
+        limit = STACK_RLIMIT_MAX;
+    }
+    return as->as_stack->vr_top - (vaddr_t) limit;
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-    // no implementation
-	(void)as;
+    struct vm_region *guard;
+    int result;
+
+    // one page to start with, vm_fault grows it as it is used
+    as->as_stack = region_create(USERSTACK - PAGE_SIZE, USERSTACK, VR_ANON,
+                                 AS_READABLE | AS_WRITEABLE);
+    if (as->as_stack == NULL) {
+        return ENOMEM;
+    }
+    result = region_insert(as, as->as_stack);
+    if (result) {
+        region_destroy(as->as_stack);
+        as->as_stack = NULL;
+        return result;
+    }
+
+    // keep a gap below the stack so running off the bottom faults
+    // instead of landing in whatever would be mapped there
+    guard = region_create(USERSTACK - PAGE_SIZE - STACK_GUARD_GAP,
+                          USERSTACK - PAGE_SIZE, VR_GUARD, 0);
+    if (guard == NULL) {
+        return ENOMEM;
+    }
+    result = region_insert(as, guard);
+    if (result) {
+        region_destroy(guard);
+        return result;
+    }
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -282,6 +596,52 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_grow_stack(struct addrspace *as, vaddr_t addr)
+{
+    struct vm_region *stack, *guard, *below;
+    vaddr_t newbase;
+    unsigned idx;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    stack = as->as_stack;
+    if (stack == NULL) {
+        return EFAULT;
+    }
+    newbase = addr & PAGE_FRAME;
+    if (addr >= stack->vr_base || newbase < stack_floor(as)) {
+        return EFAULT;
+    }
+
+    idx = region_index(as, stack->vr_base);
+    KASSERT(vm_regionarray_get(&as->as_regions, idx) == stack);
+    if (idx == 0) {
+        return EFAULT;
+    }
+    guard = vm_regionarray_get(&as->as_regions, idx - 1);
+    if (guard->vr_type != VR_GUARD || guard->vr_top != stack->vr_base) {
+        return EFAULT;
+    }
+
+    // the gap moves down with the stack and must not run into the
+    // region below it
+    if (newbase < STACK_GUARD_GAP) {
+        return EFAULT;
+    }
+    if (idx >= 2) {
+        below = vm_regionarray_get(&as->as_regions, idx - 2);
+        if (below->vr_top > newbase - STACK_GUARD_GAP) {
+            return EFAULT;
+        }
+    }
+
+    guard->vr_base = newbase - STACK_GUARD_GAP;
+    guard->vr_top = newbase;
+    stack->vr_base = newbase;
+    return 0;
+}
+
 int
 as_get_pt_entry(struct addrspace* as, vaddr_t addr, pagetable_t *pt_entry) 
 {
@@ -304,9 +664,9 @@ as_get_pt_entry(struct addrspace* as, vaddr_t addr, pagetable_t *pt_entry)
             }
             return ENOMEM;             
         }
-        // add the new pagetable to page directory
-        // upper 20 bits for pagetable address
-        as->as_pagedir[pd_idx] = (pagedir_t) (ptaddr & PAGE_FRAME);
+        // add the new pagetable to page directory, so the
+        // as_set_pt_entry that follows can't run out of memory
+        pagetable_install(as, pd_idx, (struct pagetable *) ptaddr, 0);
     }
     else {
         ptaddr = (pde & PAGE_FRAME);
@@ -319,6 +679,30 @@ as_get_pt_entry(struct addrspace* as, vaddr_t addr, pagetable_t *pt_entry)
     return 0;
 }
 
+/*
+ * Like as_get_pt_entry, but doesn't create a missing page table and
+ * just says 0 instead. The caller holds as_lock.
+ */
+pagetable_t
+as_peek_pt_entry(struct addrspace *as, vaddr_t addr)
+{
+    unsigned pd_idx = addr >> (PAGE_OFFSET_BITS + PFN_BITS);
+    unsigned pt_idx = (addr >> PAGE_OFFSET_BITS) & PFN_MASK;
+    struct pagetable *pt;
+
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    pt = (struct pagetable *) (as->as_pagedir[pd_idx] & PAGE_FRAME);
+    if (pt == NULL) {
+        return 0;
+    }
+    return pt->pt_entries[pt_idx];
+}
+
+/*
+ * Set the page table entry of page ADDR. Only clearing an entry may find
+ * no table there: a fault makes it with as_get_pt_entry before it maps
+ * the page, and anything else changes entries that are in use.
+ */
 int
 as_set_pt_entry(struct addrspace *as, vaddr_t addr, pagetable_t pt_entry)
 {
@@ -333,10 +717,24 @@ as_set_pt_entry(struct addrspace *as, vaddr_t addr, pagetable_t pt_entry)
     pagedir_t pde = as->as_pagedir[pd_idx];
     struct pagetable *pt = (struct pagetable*) (pde & PAGE_FRAME);
     if (pt == NULL) {
-        pt = create_pagetable();
+        // nothing to clear
+        KASSERT(pt_entry == 0);
+        if (!acquired) {
+            spinlock_release(&as->as_lock);
+        }
+        return 0;
     }
     
-    KASSERT(pt != NULL);
+    // keep count of the entries in use. A table that drops to none
+    // stays until as_trim_pagetable, so the caller can still put the
+    // entry back without allocating.
+    if (pt->pt_entries[pt_idx] == 0 && pt_entry != 0) {
+        as->as_ptlive[pd_idx]++;
+    }
+    else if (pt->pt_entries[pt_idx] != 0 && pt_entry == 0) {
+        KASSERT(as->as_ptlive[pd_idx] > 0);
+        as->as_ptlive[pd_idx]--;
+    }
     pt->pt_entries[pt_idx] = pt_entry;
 
     if (!acquired) {
@@ -346,48 +744,378 @@ as_set_pt_entry(struct addrspace *as, vaddr_t addr, pagetable_t pt_entry)
     return 0;
 }
 
+/*
+ * Give the page table covering ADDR back to the allocator if none of
+ * its entries are in use any more.
+ */
+void
+as_trim_pagetable(struct addrspace *as, vaddr_t addr)
+{
+    unsigned pd_idx = addr >> (PAGE_OFFSET_BITS + PFN_BITS);
+
+    bool acquired = spinlock_do_i_hold(&as->as_lock);
+    if (!acquired) {
+        spinlock_acquire(&as->as_lock);
+    }
+
+    if (as->as_pagedir[pd_idx] != 0 && as->as_ptlive[pd_idx] == 0) {
+        pagetable_remove(as, pd_idx);
+    }
+
+    if (!acquired) {
+        spinlock_release(&as->as_lock);
+    }
+}
+
 bool
 as_is_valid_address(struct addrspace* as, vaddr_t addr)
 {
+    struct vm_region *r;
+
     KASSERT(as != NULL);
-    if (addr >= as->as_code_base && addr < as->as_code_top) {
-        return true;
+    r = as_find_region(as, addr);
+    return r != NULL && r->vr_type != VR_GUARD;
+}
+
+/*
+ * Find the part of page ADDR that is backed by a file, as [*START,
+ * *END) in region *R. Returns false if there is none.
+ */
+static
+bool
+as_file_range(struct addrspace *as, vaddr_t addr, struct vm_region **r,
+              vaddr_t *start, vaddr_t *end)
+{
+    addr &= PAGE_FRAME;
+    *r = as_find_region(as, addr);
+    if (*r == NULL || (*r)->vr_vnode == NULL) {
+        return false;
     }
-    
-    if (addr >= as->as_data_base && addr < as->as_data_top) {
-        return true;
+
+    *start = (addr > (*r)->vr_filestart) ? addr : (*r)->vr_filestart;
+    *end = addr + PAGE_SIZE;
+    if (*end > (*r)->vr_filestart + (*r)->vr_filesize) {
+        *end = (*r)->vr_filestart + (*r)->vr_filesize;
     }
-    
-    if (addr >= as->as_stack_base && addr < as->as_stack_top) {
-        return true;
+    // all BSS if empty
+    return *start < *end;
+}
+
+/*
+ * Tell whether page ADDR starts out with contents from a file, rather
+ * than all zero.
+ */
+bool
+as_page_has_file_data(struct addrspace *as, vaddr_t addr)
+{
+    struct vm_region *r;
+    vaddr_t start, end;
+
+    KASSERT(as != NULL);
+    return as_file_range(as, addr, &r, &start, &end);
+}
+
+/*
+ * Tell whether page ADDR lies in a read-only segment of the executable
+ * and has file data, and if so what it holds. Such pages can be shared
+ * by everybody running the same program.
+ */
+bool
+as_page_is_text(struct addrspace *as, vaddr_t addr, struct textkey *key)
+{
+    struct vm_region *r;
+    vaddr_t start, end;
+
+    KASSERT(as != NULL);
+    addr &= PAGE_FRAME;
+    if (!as_file_range(as, addr, &r, &start, &end) ||
+        r->vr_type != VR_ELF || (r->vr_permission & AS_WRITEABLE)) {
+        return false;
     }
-    
-    if (addr >= as->as_heap_base && addr < as->as_heap_top) {
-        return true;
+
+    key->tk_vnode = r->vr_vnode;
+    key->tk_offset = r->vr_offset + (start - r->vr_filestart);
+    key->tk_head = start - addr;
+    key->tk_len = end - start;
+    return true;
+}
+
+/*
+ * Tell whether page ADDR maps a shared memory object, and if so which
+ * page of which object.
+ */
+bool
+as_page_is_shm(struct addrspace *as, vaddr_t addr, struct vnode **v, unsigned *page)
+{
+    struct vm_region *r;
+
+    KASSERT(as != NULL);
+    addr &= PAGE_FRAME;
+    r = as_find_region(as, addr);
+    if (r == NULL || r->vr_type != VR_SHM) {
+        return false;
     }
-    
-    return false;
+
+    *v = r->vr_vnode;
+    *page = (r->vr_offset + (addr - r->vr_filestart)) / PAGE_SIZE;
+    return true;
+}
+
+/*
+ * Fill the frame at PADDR with the page at ADDR. The part of the page
+ * that is backed by a file (the executable or a mapped file) is read
+ * from it, the rest of the page (BSS, heap, stack, past the end of a
+ * mapped file) is zeroed. Does I/O, so it must be called without
+ * spinlocks held.
+ */
+int
+as_load_page(struct addrspace *as, vaddr_t addr, paddr_t paddr)
+{
+    struct vm_region *r;
+    vaddr_t start, end;
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    KASSERT(as != NULL);
+    addr &= PAGE_FRAME;
+    bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+    if (!as_file_range(as, addr, &r, &start, &end)) {
+        return 0;
+    }
+
+    uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(paddr + (start - addr)),
+              end - start, r->vr_offset + (start - r->vr_filestart), UIO_READ);
+    result = VOP_READ(r->vr_vnode, &ku);
+    if (result) {
+        return result;
+    }
+
+    // a mapping may reach past the end of its file, a segment may not
+    if (ku.uio_resid != 0 && r->vr_type == VR_ELF) {
+        /* short read; problem with executable? */
+        kprintf("ELF: short read on segment - file truncated?\n");
+        return ENOEXEC;
+    }
+    return 0;
 }
 
 unsigned
 as_get_permission(struct addrspace *as, vaddr_t addr)
 {
+    struct vm_region *r;
+
     KASSERT(as != NULL);
-    if (addr >= as->as_code_base && addr < as->as_code_top) {
-        return as->as_code_permission;
+    r = as_find_region(as, addr);
+    return (r != NULL) ? r->vr_permission : 0;
+}
+
+/*
+ * Write the frame at PADDR back to the shared file mapping that page
+ * ADDR belongs to. Only the part of the page that lies within the file
+ * is written; mapping a file never makes it longer. Does I/O, so it
+ * must be called without spinlocks held.
+ */
+int
+as_store_page(struct addrspace *as, vaddr_t addr, paddr_t paddr)
+{
+    struct vm_region *r;
+    struct stat st;
+    struct iovec iov;
+    struct uio ku;
+    off_t offset;
+    size_t len;
+    int result;
+
+    addr &= PAGE_FRAME;
+    r = as_find_region(as, addr);
+    KASSERT(r != NULL && r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED));
+
+    result = VOP_STAT(r->vr_vnode, &st);
+    if (result) {
+        return result;
     }
-    
-    if (addr >= as->as_data_base && addr < as->as_data_top) {
-        return as->as_data_permission;
+
+    offset = r->vr_offset + (addr - r->vr_filestart);
+    if (offset >= st.st_size) {
+        return 0;
     }
-    
-    if (addr >= as->as_stack_base && addr < as->as_stack_top) {
-        return as->as_stack_permission;
+    len = PAGE_SIZE;
+    if (st.st_size - offset < PAGE_SIZE) {
+        len = st.st_size - offset;
     }
-    
-    if (addr >= as->as_heap_base && addr >= as->as_heap_top) {
-        return as->as_heap_permission;
+
+    uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(paddr), len, offset, UIO_WRITE);
+    result = VOP_WRITE(r->vr_vnode, &ku);
+    if (result) {
+        return result;
+    }
+
+    // someone may be running the file we just changed
+    vm_textcache_purge(r->vr_vnode);
+    return 0;
+}
+
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t addr)
+{
+    struct vm_region *r;
+    unsigned idx = region_index(as, addr);
+
+    if (idx == vm_regionarray_num(&as->as_regions)) {
+        return NULL;
+    }
+    r = vm_regionarray_get(&as->as_regions, idx);
+    return (r->vr_base <= addr) ? r : NULL;
+}
+
+bool
+as_range_is_free(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    unsigned idx = region_index(as, start);
+
+    return idx == vm_regionarray_num(&as->as_regions) ||
+           vm_regionarray_get(&as->as_regions, idx)->vr_base >= end;
+}
+
+int
+as_define_mmap(struct addrspace *as, vaddr_t *addr, size_t len,
+               unsigned permission, int flags, struct vnode *v, off_t offset)
+{
+    struct vm_region *r;
+    vaddr_t base, ceiling, floor;
+    unsigned idx, type;
+    int result;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+    KASSERT(as->as_heap != NULL && as->as_stack != NULL);
+
+    // the heap may still grow up to floor, and the stack down to its
+    // limit plus the guard gap
+    floor = as->as_heap->vr_base + MAX_HEAP;
+    ceiling = stack_floor(as) - STACK_GUARD_GAP;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if (flags & MAP_FIXED) {
+        base = *addr;
+        if ((base & ~PAGE_FRAME) != 0 || base < floor) {
+            return EINVAL;
+        }
+    }
+    else {
+        base = floor;
+    }
+
+    // first fit: move BASE past every region in the way
+    idx = region_index(as, base);
+    while (idx < vm_regionarray_num(&as->as_regions)) {
+        r = vm_regionarray_get(&as->as_regions, idx);
+        if (r->vr_base >= base + len) {
+            break;
+        }
+        if (flags & MAP_FIXED) {
+            return EINVAL;
+        }
+        base = r->vr_top;
+        idx++;
+    }
+    if (flags & MAP_FIXED) {
+        // asked for explicitly, it only has to stay clear of the stack
+        ceiling = as->as_stack->vr_base;
+    }
+    if (base + len < base || base + len > ceiling) {
+        return ENOMEM;
+    }
+
+    if (v == NULL) {
+        type = VR_ANON;
+    }
+    else {
+        type = shm_isobject(v) ? VR_SHM : VR_FILE;
+    }
+    r = region_create(base, base + len, type, permission);
+    if (r == NULL) {
+        return ENOMEM;
+    }
+    r->vr_flags = flags & (MAP_SHARED | MAP_PRIVATE | MAP_ANON);
+    if (v != NULL) {
+        VOP_INCREF(v);
+        r->vr_vnode = v;
+        r->vr_offset = offset;
+        r->vr_filestart = base;
+        r->vr_filesize = len;
+    }
+
+    result = vm_regionarray_insert(&as->as_regions, idx, r);
+    if (result) {
+        region_destroy(r);
+        return result;
+    }
+
+    *addr = base;
+    return 0;
+}
+
+int
+as_remove_mmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    struct vm_region *r, *tail;
+    unsigned idx;
+    int result;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    idx = region_index(as, start);
+    while (idx < vm_regionarray_num(&as->as_regions)) {
+        r = vm_regionarray_get(&as->as_regions, idx);
+        if (r->vr_base >= end) {
+            break;
+        }
+        if (r->vr_flags == 0) {
+            // not made by mmap: the heap, the stack or the executable
+            idx++;
+            continue;
+        }
+
+        if (r->vr_base < start && r->vr_top > end) {
+            // punching a hole: the part above it becomes a region of
+            // its own
+            tail = kmalloc(sizeof(struct vm_region));
+            if (tail == NULL) {
+                return ENOMEM;
+            }
+            *tail = *r;
+            tail->vr_base = end;
+            if (tail->vr_vnode != NULL) {
+                VOP_INCREF(tail->vr_vnode);
+            }
+            result = vm_regionarray_insert(&as->as_regions, idx + 1, tail);
+            if (result) {
+                region_destroy(tail);
+                return result;
+            }
+            vm_unmap(as, start, (end - start) / PAGE_SIZE);
+            r->vr_top = start;
+            return 0;
+        }
+
+        if (r->vr_base >= start && r->vr_top <= end) {
+            vm_unmap(as, r->vr_base, (r->vr_top - r->vr_base) / PAGE_SIZE);
+            vm_regionarray_remove(&as->as_regions, idx);
+            region_destroy(r);
+            continue;
+        }
+
+        if (r->vr_base < start) {
+            vm_unmap(as, start, (r->vr_top - start) / PAGE_SIZE);
+            r->vr_top = start;
+        }
+        else {
+            vm_unmap(as, r->vr_base, (end - r->vr_base) / PAGE_SIZE);
+            r->vr_base = end;
+        }
+        idx++;
     }
-    
     return 0;
 }
@@ -0,0 +1,413 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <stat.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <shm.h>
+
+/*
+ * A shared memory object. Its frames belong to the object, which holds
+ * a reference on each, and are mapped by the processes that touch its
+ * pages; they are never paged out. The pages of the object are
+ * committed with vm_commit as soon as it is sized.
+ */
+struct shm_object {
+    struct vnode so_vnode;
+    char *so_name;              // NULL when not in shm_table
+    struct lock *so_lock;       // size and frames
+    off_t so_size;
+    unsigned so_npages;         // DIVROUNDUP(so_size, PAGE_SIZE)
+    paddr_t *so_frames;         // page by page, 0 until first touched
+};
+
+// Lock order: shm_lock, so_lock, coremap_lock. The table holds one
+// reference on every object in it.
+static struct lock *shm_lock;
+static struct shm_object *shm_table[SHM_MAX_OBJECTS];
+
+/*
+ *  shm_bootstrap - set up the name table
+ *
+ */
+void
+shm_bootstrap(void)
+{
+    shm_lock = lock_create("shm");
+    if (shm_lock == NULL) {
+        panic("shm_bootstrap: out of memory\n");
+    }
+}
+
+static
+int
+shm_eachopen(struct vnode *v, int flags)
+{
+    (void)v;
+    (void)flags;
+    return 0;
+}
+
+/*
+ *  shm_reclaim - destroy an object whose last reference went away.
+ *  Frames that are still mapped, after a shrink, go with the last of
+ *  their mappings.
+ *
+ */
+static
+int
+shm_reclaim(struct vnode *v)
+{
+    struct shm_object *so = v->vn_data;
+    unsigned i;
+
+    // nobody can find it any more
+    KASSERT(so->so_name == NULL);
+
+    for (i = 0; i < so->so_npages; i++) {
+        if (so->so_frames[i] != 0) {
+            vm_shm_release(so->so_frames[i]);
+        }
+    }
+    vm_uncommit(so->so_npages);
+
+    vnode_cleanup(&so->so_vnode);
+    lock_destroy(so->so_lock);
+    kfree(so->so_frames);
+    kfree(so);
+    return 0;
+}
+
+static
+int
+shm_ioctl(struct vnode *v, int op, userptr_t data)
+{
+    (void)v;
+    (void)op;
+    (void)data;
+    return EINVAL;
+}
+
+static
+int
+shm_stat(struct vnode *v, struct stat *buf)
+{
+    struct shm_object *so = v->vn_data;
+
+    bzero(buf, sizeof(*buf));
+
+    lock_acquire(shm_lock);
+    buf->st_nlink = (so->so_name != NULL) ? 1 : 0;
+    lock_release(shm_lock);
+
+    lock_acquire(so->so_lock);
+    buf->st_size = so->so_size;
+    lock_release(so->so_lock);
+
+    buf->st_mode = S_IFREG | 0666;
+    return 0;
+}
+
+static
+int
+shm_gettype(struct vnode *v, mode_t *ret)
+{
+    (void)v;
+    *ret = S_IFREG;
+    return 0;
+}
+
+static
+bool
+shm_isseekable(struct vnode *v)
+{
+    // it is only read and written through mmap
+    (void)v;
+    return false;
+}
+
+static
+int
+shm_fsync(struct vnode *v)
+{
+    (void)v;
+    return 0;
+}
+
+static
+int
+shm_mmap(struct vnode *v)
+{
+    (void)v;
+    return 0;
+}
+
+/*
+ *  shm_truncate - make the object LEN bytes long. New pages are zero.
+ *  Pages cut off stay with the processes that have them mapped until
+ *  they unmap them, but are gone from the object.
+ *
+ */
+static
+int
+shm_truncate(struct vnode *v, off_t len)
+{
+    struct shm_object *so = v->vn_data;
+    paddr_t *frames;
+    unsigned npages, i;
+    int result;
+
+    if (len < 0) {
+        return EINVAL;
+    }
+    if (len > (off_t) USERSPACETOP) {
+        return EFBIG;
+    }
+    npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    lock_acquire(so->so_lock);
+    if (npages > so->so_npages) {
+        result = vm_commit(npages - so->so_npages);
+        if (result) {
+            lock_release(so->so_lock);
+            return result;
+        }
+        frames = kmalloc(npages * sizeof(paddr_t));
+        if (frames == NULL) {
+            vm_uncommit(npages - so->so_npages);
+            lock_release(so->so_lock);
+            return ENOMEM;
+        }
+        bzero(frames, npages * sizeof(paddr_t));
+        for (i = 0; i < so->so_npages; i++) {
+            frames[i] = so->so_frames[i];
+        }
+        kfree(so->so_frames);
+        so->so_frames = frames;
+    }
+    else {
+        for (i = npages; i < so->so_npages; i++) {
+            if (so->so_frames[i] != 0) {
+                vm_shm_release(so->so_frames[i]);
+                so->so_frames[i] = 0;
+            }
+        }
+        vm_uncommit(so->so_npages - npages);
+    }
+    so->so_npages = npages;
+    so->so_size = len;
+    lock_release(so->so_lock);
+
+    return 0;
+}
+
+static const struct vnode_ops shm_vnops = {
+    .vop_magic = VOP_MAGIC,
+
+    .vop_eachopen = shm_eachopen,
+    .vop_reclaim = shm_reclaim,
+
+    .vop_read = vopfail_uio_inval,
+    .vop_readlink = vopfail_uio_inval,
+    .vop_getdirentry = vopfail_uio_notdir,
+    .vop_write = vopfail_uio_inval,
+    .vop_ioctl = shm_ioctl,
+    .vop_stat = shm_stat,
+    .vop_gettype = shm_gettype,
+    .vop_isseekable = shm_isseekable,
+    .vop_fsync = shm_fsync,
+    .vop_mmap = shm_mmap,
+    .vop_truncate = shm_truncate,
+    .vop_namefile = vopfail_uio_notdir,
+
+    .vop_creat = vopfail_creat_notdir,
+    .vop_symlink = vopfail_symlink_notdir,
+    .vop_mkdir = vopfail_mkdir_notdir,
+    .vop_link = vopfail_link_notdir,
+    .vop_remove = vopfail_string_notdir,
+    .vop_rmdir = vopfail_string_notdir,
+    .vop_rename = vopfail_rename_notdir,
+    .vop_lookup = vopfail_lookup_notdir,
+    .vop_lookparent = vopfail_lookparent_notdir,
+};
+
+/*
+ *  shm_object_create - make an empty object, with one reference for
+ *  the caller
+ *
+ */
+static
+struct shm_object *
+shm_object_create(void)
+{
+    struct shm_object *so;
+
+    so = kmalloc(sizeof(struct shm_object));
+    if (so == NULL) {
+        return NULL;
+    }
+    so->so_lock = lock_create("shm object");
+    if (so->so_lock == NULL) {
+        kfree(so);
+        return NULL;
+    }
+    so->so_name = NULL;
+    so->so_size = 0;
+    so->so_npages = 0;
+    so->so_frames = NULL;
+    vnode_init(&so->so_vnode, &shm_vnops, NULL, so);
+    return so;
+}
+
+bool
+shm_isobject(struct vnode *v)
+{
+    return v->vn_ops == &shm_vnops;
+}
+
+/*
+ *  shm_lookup - the index of NAME in shm_table, or SHM_MAX_OBJECTS.
+ *  Called with shm_lock held.
+ *
+ */
+static
+unsigned
+shm_lookup(const char *name)
+{
+    unsigned i;
+
+    KASSERT(lock_do_i_hold(shm_lock));
+
+    for (i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (shm_table[i] != NULL && !strcmp(shm_table[i]->so_name, name)) {
+            break;
+        }
+    }
+    return i;
+}
+
+int
+shm_open(const char *name, int flags, struct vnode **ret)
+{
+    struct shm_object *so;
+    unsigned i;
+
+    lock_acquire(shm_lock);
+    i = shm_lookup(name);
+    if (i < SHM_MAX_OBJECTS) {
+        if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            lock_release(shm_lock);
+            return EEXIST;
+        }
+        so = shm_table[i];
+        VOP_INCREF(&so->so_vnode);
+    }
+    else {
+        if (!(flags & O_CREAT)) {
+            lock_release(shm_lock);
+            return ENOENT;
+        }
+        for (i = 0; i < SHM_MAX_OBJECTS && shm_table[i] != NULL; i++);
+        if (i == SHM_MAX_OBJECTS) {
+            lock_release(shm_lock);
+            return ENFILE;
+        }
+        so = shm_object_create();
+        if (so == NULL) {
+            lock_release(shm_lock);
+            return ENOMEM;
+        }
+        so->so_name = kstrdup(name);
+        if (so->so_name == NULL) {
+            lock_release(shm_lock);
+            VOP_DECREF(&so->so_vnode);
+            return ENOMEM;
+        }
+        // one reference for the table, one for the caller
+        shm_table[i] = so;
+        VOP_INCREF(&so->so_vnode);
+    }
+    lock_release(shm_lock);
+
+    if (flags & O_TRUNC) {
+        // shrinking can't fail
+        shm_truncate(&so->so_vnode, 0);
+    }
+
+    *ret = &so->so_vnode;
+    return 0;
+}
+
+int
+shm_unlink(const char *name)
+{
+    struct shm_object *so;
+    char *oldname;
+    unsigned i;
+
+    lock_acquire(shm_lock);
+    i = shm_lookup(name);
+    if (i == SHM_MAX_OBJECTS) {
+        lock_release(shm_lock);
+        return ENOENT;
+    }
+    so = shm_table[i];
+    shm_table[i] = NULL;
+    oldname = so->so_name;
+    so->so_name = NULL;
+    lock_release(shm_lock);
+
+    kfree(oldname);
+    // the table's reference, may be the last
+    VOP_DECREF(&so->so_vnode);
+    return 0;
+}
+
+int
+shm_create(size_t len, struct vnode **ret)
+{
+    struct shm_object *so;
+    int result;
+
+    so = shm_object_create();
+    if (so == NULL) {
+        return ENOMEM;
+    }
+    result = shm_truncate(&so->so_vnode, len);
+    if (result) {
+        VOP_DECREF(&so->so_vnode);
+        return result;
+    }
+
+    *ret = &so->so_vnode;
+    return 0;
+}
+
+int
+shm_getpage(struct vnode *v, unsigned page, paddr_t *ret)
+{
+    struct shm_object *so = v->vn_data;
+
+    KASSERT(shm_isobject(v));
+
+    lock_acquire(so->so_lock);
+    if (page >= so->so_npages) {
+        // mapped past the end of the object
+        lock_release(so->so_lock);
+        return EFAULT;
+    }
+    if (so->so_frames[page] == 0) {
+        so->so_frames[page] = vm_shm_alloc();
+        if (so->so_frames[page] == 0) {
+            lock_release(so->so_lock);
+            return ENOMEM;
+        }
+    }
+    vm_shm_ref(so->so_frames[page]);
+    *ret = so->so_frames[page];
+    lock_release(so->so_lock);
+
+    return 0;
+}
@@ -14,35 +14,129 @@
 #include <signal.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <uio.h>
+#include <stat.h>
 #include <vnode.h>
+#include <wchan.h>
+#include <bitmap.h>
+#include <clock.h>
+#include <membar.h>
+#include <zswap.h>
+#include <shm.h>
 
-#define SWAP 0
 
+// ASID part of as_asid[] and c_asid_cache, the rest is the generation
+#define ASID_MASK           (NUM_ASID - 1)
 
 // declare a global coremap
 uint32_t user_base_addr;
-uint32_t* _coremap;
+struct coremap_entry *_coremap;
 struct swapentries * _swapmap;
+unsigned *_swaphash;            // heads of the swap hash chains
+struct bitmap *_swapfree;       // swap slots in use
 
-struct lock *global_lock;
 struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
-struct spinlock tlb_lock = SPINLOCK_INITIALIZER;
-struct spinlock sbrk_lock = SPINLOCK_INITIALIZER;
+struct wchan *coremap_wchan;    // waiting for a busy frame
+struct wchan *pageout_wchan;    // pageout thread waits here for work
 
 // range of entry indices controlled by VM
 unsigned last_page;
-unsigned nfreepages;
-unsigned next_free;     // next location for page allocation
+unsigned nbuddypages;           // free frames in the buddy lists, under coremap_lock
+static unsigned buddy_heads[BUDDY_MAX_ORDER + 1];   // free lists by order
 
-struct vnode *swap_vnode;
 struct spinlock swapmap_lock = SPINLOCK_INITIALIZER;
-char swap_file[] = "lhd0raw:";
+unsigned swap_nslots;           // slots on all devices together
+#if SWAP
+// raw disks to swap to, those that are there are used round-robin
+static char swap_devices[] = SWAP_DEVICES;    // split up by swap_attach
+static struct swapdev swapdevs[SWAP_MAX_DEVICES];
+static unsigned nswapdevs;
+static unsigned swap_nextdev;   // device the next run is taken from
+static unsigned swap_hashsize;  // buckets in _swaphash, a power of 2
+static unsigned swap_writes;            // pages written to swap
+static unsigned swap_cache_drops;       // clean pages evicted without a write
+#endif
 unsigned swapclock;     // next victim for page replacement
 unsigned swap_base;
 unsigned swap_last_page; 
 
 bool vm_initialized = false;
+paddr_t zero_frame;     // shared by every page not written yet
+unsigned vm_faultaround = FAULT_AROUND;    // pages, a power of two
+static unsigned ncommitted;     // heap pages sbrk has promised, under coremap_lock
+
+/*
+ * Text page cache. Frames holding pages of read-only executable
+ * segments are found by their textkey, so everybody running the same
+ * program maps the same frames, copy-on-write. The cache holds a
+ * reference on each of its frames, so they outlive the processes using
+ * them, and one on the vnode of each page, so the vnode can't be
+ * reclaimed and reused for another file meanwhile. Pages leave when
+ * the clock hand or a frame allocator that ran dry takes their frame,
+ * and when their file is written. All under coremap_lock; the vnodes
+ * of dropped pages are let go by textcache_reap, without spinlocks.
+ */
+struct textpage {
+    struct textkey tp_key;
+    unsigned tp_frame;
+    struct textpage *tp_next;       // hash chain, then textcache_dead
+};
+static struct textpage *textcache[TEXT_HASH_SIZE];
+static struct textpage *textcache_dead;     // dropped, vnode still referenced
+static unsigned textcache_hand;             // bucket textcache_reclaim starts at
+static unsigned ntextpages;
+static unsigned text_hits, text_misses;
+
+/*
+ * Same-page merging. When turned on with vm_set_ksm, the ksm thread
+ * walks the coremap with its own hand and checksums private user
+ * frames. A frame whose checksum did not change since the hand last
+ * passed is merged into a frame with the same contents: the zero
+ * frame, a merged frame from ksm_table, or one that matched earlier in
+ * this pass (ksm_unstable), which becomes a merged frame first. Merged
+ * frames are mapped copy-on-write and have PP_KSM set; they leave
+ * ksm_table when the last owner writes to or drops them. The per
+ * frame arrays are allocated the first time KSM is turned on and are
+ * kept under coremap_lock.
+ */
+static unsigned ksm_npages;         // frames checksummed a second, 0 = off
+static bool ksm_running;            // the thread is there
+static unsigned ksm_hand;
+static uint32_t *ksm_sum;           // per frame: checksum at the last visit
+static unsigned *ksm_next;          // per frame: next in the ksm_table chain
+static unsigned ksm_table[KSM_HASH_SIZE];       // merged frames by checksum
+static unsigned ksm_unstable[KSM_HASH_SIZE];    // candidates seen this pass
+static unsigned ksm_nframes;        // frames in ksm_table
+static unsigned ksm_merges, ksm_zero_merges, ksm_passes;
+
+static void buddy_free_range(unsigned idx, unsigned npages);
+static unsigned free_frames(void);
+static unsigned frame_drain_cpus(bool all);
+static vaddr_t acquire_one_page(void);
+static bool textcache_reclaim(void);
+static void ksm_unlink(unsigned idx);
+
+#if SWAP
+static void swap_attach(void);
+static void pageout_thread(void *unused1, unsigned long unused2);
+#endif
+
+/*
+ *  pageout_kick - wake the pageout thread once free frames drop below
+ *  the low watermark. Called with coremap_lock held.
+ *
+ */
+static
+void
+pageout_kick(void)
+{
+#if SWAP
+    if (free_frames() < PAGEOUT_LOW && pageout_wchan != NULL) {
+        wchan_wakeone(pageout_wchan, &coremap_lock);
+    }
+#endif
+}
 
 /*
  *  vm_bootstrap - Initialize vm
@@ -54,52 +148,265 @@ vm_bootstrap ()
     uint32_t i;
     
     spinlock_init(&coremap_lock);
-    spinlock_init(&tlb_lock);
-    global_lock = lock_create("global_lock");
-    spinlock_init(&sbrk_lock);
     spinlock_init(&swapmap_lock);
+    coremap_wchan = wchan_create("coremap");
+    if (coremap_wchan == NULL) {
+        panic("vm_bootstrap: could not create coremap wchan\n");
+    }
 
     // compute the range of pages to be controlled by VM
     uint32_t ramsize = ram_getsize();
     uint32_t num_entries = (ramsize - ram_stealmem(0)) / PAGE_SIZE;    
-    _coremap = kmalloc(num_entries * sizeof(uint32_t));
+    _coremap = kmalloc(num_entries * sizeof(struct coremap_entry));
 
     user_base_addr = ram_stealmem(0);
     last_page = (ramsize - user_base_addr) / PAGE_SIZE;
 
-    next_free = swapclock = 0;
-    nfreepages = last_page;
+    swapclock = 0;
+    nbuddypages = last_page;
     vm_initialized = true;
     for (i=0; i<last_page; i++) {
-        _coremap[i] = PP_FREE;    
+        _coremap[i].cm_entry = PP_FREE;
+        _coremap[i].cm_refcount = 0;
+        _coremap[i].cm_busy = 0;
+        _coremap[i].cm_order = BUDDY_NONE;
+        _coremap[i].cm_as = NULL;
+        _coremap[i].cm_rmap = NULL;
+    }
+    for (i=0; i<=BUDDY_MAX_ORDER; i++) {
+        buddy_heads[i] = NO_FRAME;
     }
+    buddy_free_range(0, last_page);
+
+    // never freed, and with no owner it is never paged out
+    zero_frame = acquire_one_page();
+    KASSERT(zero_frame != 0);
+    bzero((void *) PADDR_TO_KVADDR(zero_frame), PAGE_SIZE);
+
+    shm_bootstrap();
 
 #if SWAP
-    //Initialize swap stuff
-    if (vfs_open(swap_file, O_RDWR, 0, &swap_vnode)) {
-        panic("Error openning swapfile\n");
-    }
+    // the swap map is as big as the disks we find
+    swap_attach();
     swap_base = last_page;
-    _swapmap = kmalloc(NUM_SW_PAGES * sizeof(struct swapentries));
-    for (unsigned i = 0; i < NUM_SW_PAGES; i++) {
+    for (swap_hashsize = 1; swap_hashsize < swap_nslots; swap_hashsize <<= 1);
+    _swapmap = kmalloc(swap_nslots * sizeof(struct swapentries));
+    _swaphash = kmalloc(swap_hashsize * sizeof(unsigned));
+    _swapfree = bitmap_create(swap_nslots);
+    if (_swapmap == NULL || _swaphash == NULL || _swapfree == NULL) {
+        panic("vm_bootstrap: out of memory for the swap map\n");
+    }
+    for (unsigned i = 0; i < swap_nslots; i++) {
         _swapmap[i].in_use = false;
+        _swapmap[i].next = NO_SWAP_IDX;
+    }
+    for (unsigned i = 0; i < swap_hashsize; i++) {
+        _swaphash[i] = NO_SWAP_IDX;
+    }
+    zswap_bootstrap(swap_nslots, last_page / ZSWAP_POOL_SHARE);
+
+    pageout_wchan = wchan_create("pageout");
+    if (pageout_wchan == NULL) {
+        panic("vm_bootstrap: could not create pageout wchan\n");
+    }
+    if (thread_fork("pageout", NULL, pageout_thread, NULL, 0)) {
+        panic("vm_bootstrap: could not start the pageout thread\n");
     }
 #endif
 }
-/*_
- *  vm_tlbshootdown - Remove an entry from another CPU’s TLB address mapping
+/*
+ *  vm_activate - make AS the current address space of this CPU's TLB,
+ *  handing it a new ASID if it has none from the current generation,
+ *  and return that ASID. Running out of ASIDs starts a new generation;
+ *  that is the only time the TLB is flushed. An as_asid[] of 0 means
+ *  none, so the counter never hands that value out.
+ *
+ */
+uint32_t
+vm_activate(struct addrspace *as)
+{
+    struct cpu *c;
+    uint32_t asid;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+
+    // publish first: a shootdown that misses us here must see our ASID
+    // dropped below (see tlb_shootdown)
+    c->c_curas = as;
+    membar_any_any();
+
+    asid = as->as_asid[c->c_number];
+    if (asid == 0 || (asid & ~ASID_MASK) != (c->c_asid_cache & ~ASID_MASK)) {
+        c->c_asid_cache++;
+        if ((c->c_asid_cache & ASID_MASK) == 0) {
+            // every ASID of this generation has been used
+            vm_tlbinvalidate();
+            if (c->c_asid_cache == 0) {
+                c->c_asid_cache = NUM_ASID;
+            }
+        }
+        asid = c->c_asid_cache;
+        as->as_asid[c->c_number] = asid;
+    }
+    tlb_setasid(asid & ASID_MASK);
+    splx(spl);
+
+    return asid & ASID_MASK;
+}
+
+/*
+ *  vm_tlbshootdown - drop the TLB entry for TS on this CPU, or all of
+ *  the entries of its address space if ts_vaddr is TLBSHOOTDOWN_AS.
+ *  Runs from interprocessor_interrupt, and locally for our own share
+ *  of a shootdown.
  *
  */
 void
-vm_tlbshootdown (const struct tlbshootdown *tlb)
+vm_tlbshootdown (const struct tlbshootdown *ts)
 {
-    (void) tlb;
+    struct cpu *c;
+    struct addrspace *as = ts->ts_as;
+    uint32_t asid;
+    int spl, idx;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+    asid = as->as_asid[c->c_number];
+
+    if (asid == 0 || (asid & ~ASID_MASK) != (c->c_asid_cache & ~ASID_MASK)) {
+        // nothing of AS can match under a live ASID, but vm_activate may
+        // have read the ASID the sender then dropped and still be
+        // running on it: move to a fresh one
+        if (c->c_curas == as) {
+            vm_activate(as);
+        }
+    }
+    else if (ts->ts_vaddr == TLBSHOOTDOWN_AS) {
+        as->as_asid[c->c_number] = 0;
+        if (c->c_curas == as) {
+            vm_activate(as);
+        }
+    }
+    else {
+        idx = tlb_probe((ts->ts_vaddr & TLBHI_VPAGE) | ((asid & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+        if (idx >= 0) {
+            tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+        }
+    }
+
+    splx(spl);
 }
 
+/*
+ *  vm_tlbshootdown_all - too many shootdowns were queued for us, drop
+ *  everything
+ *
+ */
 void
 vm_tlbshootdown_all(void)
 {
+    vm_tlbinvalidate();
+}
+
+/*
+ *  tlb_shootdown - drop the TLB entries for the N pages in VADDRS of AS
+ *  (all of them if N is 0) on every CPU, and wait until it is done.
+ *
+ *  CPUs where AS is not current just lose its ASID, so its entries
+ *  there can never match again; no interrupt is needed. CPUs running
+ *  AS are sent the whole batch, which ipi_tlbshootdown delivers with
+ *  one IPI. Must be called without spinlocks held, since we wait for
+ *  the other CPUs with interrupts on (they may be waiting for us too).
+ *
+ */
+static
+void
+tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs, unsigned n)
+{
+    struct tlbshootdown ts;
+    unsigned tickets[MAXCPUS];
+    bool sent[MAXCPUS];
+    struct cpu *c;
+    unsigned i, j;
+    int spl;
+
+    KASSERT(curcpu->c_spinlocks == 0);
+
+    ts.ts_as = as;
+    if (n > TLBSHOOTDOWN_MAX) {
+        n = 0;
+    }
+
+    spl = splhigh();
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        sent[i] = false;
+        if (c == curcpu->c_self) {
+            continue;
+        }
+        if (c->c_curas != as) {
+            as->as_asid[i] = 0;
+            // pairs with vm_activate: either it sees the 0 or we see it
+            // (and if it read the old ASID first, the IPI moves it off)
+            membar_any_any();
+            if (c->c_curas != as) {
+                continue;
+            }
+        }
+
+        if (n == 0) {
+            ts.ts_vaddr = TLBSHOOTDOWN_AS;
+            ipi_tlbshootdown(c, &ts);
+        }
+        for (j = 0; j < n; j++) {
+            ts.ts_vaddr = vaddrs[j];
+            ipi_tlbshootdown(c, &ts);
+        }
+        tickets[i] = c->c_shootdown_posted;
+        sent[i] = true;
+    }
+
+    // our own share
+    if (n == 0) {
+        ts.ts_vaddr = TLBSHOOTDOWN_AS;
+        vm_tlbshootdown(&ts);
+    }
+    for (j = 0; j < n; j++) {
+        ts.ts_vaddr = vaddrs[j];
+        vm_tlbshootdown(&ts);
+    }
+    splx(spl);
+
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        if (!sent[i]) {
+            continue;
+        }
+        while ((int) (c->c_shootdown_done - tickets[i]) < 0) {
+            membar_load_load();
+        }
+    }
+}
+
+/*
+ *  vm_tlbshootdown_page - forget the translation of page VADDR of AS
+ *  on every CPU after its page table entry changed
+ *
+ */
+void
+vm_tlbshootdown_page(struct addrspace *as, vaddr_t vaddr)
+{
+    tlb_shootdown(as, &vaddr, 1);
+}
 
+/*
+ *  vm_tlbflush_as - forget every translation of AS on every CPU
+ *
+ */
+void
+vm_tlbflush_as(struct addrspace *as)
+{
+    tlb_shootdown(as, NULL, 0);
 }
 
 void
@@ -116,155 +423,553 @@ vm_tlbinvalidate(void)
 	splx(spl);
 }
 
+/*
+ *  buddy_push - put the free block of 2^ORDER frames at IDX on its
+ *  free list
+ *
+ */
+static
+void
+buddy_push(unsigned idx, unsigned order)
+{
+    _coremap[idx].cm_order = order;
+    _coremap[idx].cm_prev = NO_FRAME;
+    _coremap[idx].cm_next = buddy_heads[order];
+    if (buddy_heads[order] != NO_FRAME) {
+        _coremap[buddy_heads[order]].cm_prev = idx;
+    }
+    buddy_heads[order] = idx;
+}
+
+/*
+ *  buddy_unlink - take the free block at IDX off its free list
+ *
+ */
+static
+void
+buddy_unlink(unsigned idx)
+{
+    unsigned order = _coremap[idx].cm_order;
+    unsigned next = _coremap[idx].cm_next;
+    unsigned prev = _coremap[idx].cm_prev;
+
+    KASSERT(order <= BUDDY_MAX_ORDER);
+    if (prev != NO_FRAME) {
+        _coremap[prev].cm_next = next;
+    }
+    else {
+        buddy_heads[order] = next;
+    }
+    if (next != NO_FRAME) {
+        _coremap[next].cm_prev = prev;
+    }
+    _coremap[idx].cm_order = BUDDY_NONE;
+}
+
+/*
+ *  buddy_free - return the 2^ORDER frames at IDX, merging them with
+ *  their buddy for as long as it is free too
+ *
+ */
+static
+void
+buddy_free(unsigned idx, unsigned order)
+{
+    unsigned buddy;
+
+    while (order < BUDDY_MAX_ORDER) {
+        buddy = idx ^ (1u << order);
+        if (buddy + (1u << order) > last_page ||
+            _coremap[buddy].cm_order != order) {
+            break;
+        }
+        buddy_unlink(buddy);
+        idx &= ~(1u << order);
+        order++;
+    }
+    buddy_push(idx, order);
+}
+
+/*
+ *  buddy_free_range - return NPAGES frames starting at IDX, split into
+ *  the largest aligned blocks that fit
+ *
+ */
+static
+void
+buddy_free_range(unsigned idx, unsigned npages)
+{
+    unsigned order;
+
+    while (npages > 0) {
+        order = 0;
+        while (order < BUDDY_MAX_ORDER && (idx & (1u << order)) == 0 &&
+               (2u << order) <= npages) {
+            order++;
+        }
+        buddy_free(idx, order);
+        idx += 1u << order;
+        npages -= 1u << order;
+    }
+}
+
+/*
+ *  buddy_alloc - take a free block of 2^ORDER frames, splitting a
+ *  larger one if needed. Returns its first frame or NO_FRAME.
+ *
+ */
+static
+unsigned
+buddy_alloc(unsigned order)
+{
+    unsigned o, idx;
+
+    for (o = order; o <= BUDDY_MAX_ORDER; o++) {
+        if (buddy_heads[o] != NO_FRAME) {
+            break;
+        }
+    }
+    if (o > BUDDY_MAX_ORDER) {
+        return NO_FRAME;
+    }
+
+    idx = buddy_heads[o];
+    buddy_unlink(idx);
+    // hand the upper halves back
+    while (o > order) {
+        o--;
+        buddy_push(idx + (1u << o), o);
+    }
+    return idx;
+}
+
 static
 paddr_t
 acquire_pages (unsigned npages)
 {
-    unsigned nfree = 0;
-    unsigned start = next_free;
-    unsigned i, j;
-    uint32_t entry;
+    unsigned order = 0;
+    unsigned start, j;
     paddr_t ppage_addr = 0;
     bool acquired = spinlock_do_i_hold(&coremap_lock);
     
+    while ((1u << order) < npages) {
+        order++;
+    }
+    if (order > BUDDY_MAX_ORDER) {
+        return 0;
+    }
+
     if (!acquired) {
         spinlock_acquire(&coremap_lock);
     }
     
-//    lock_acquire(cm_lock);
-    
-    for (i=0; i<last_page; i++) {
-        entry = _coremap[start];
-        if (IS_PPAGE_FREE(entry)) {
-            nfree++;
-        }
-        else {
-            nfree = 0;
-        }
-        start++;
-        if (start >= last_page) {
-            // we don't support wrap around:
-            // continous pages don't wrap around 
-            start = 0;
-            nfree = 0;
-        }
-
-        if (nfree == npages) {
-            // found
-            // update next_free
-            next_free = start;
-            pid_t pid = curproc->pid;
-            pid <<= 6;
-
-            // mark all these pages as used
-            for (j=0; j<npages; j++) {
-                start--;
-                if (j==0) {
-                    _coremap[start] = (PP_ALLOC_END | PP_DIRTY | PP_USE | pid);
-                    nfreepages--;
-                }
-                else {
-                    _coremap[start] = (PP_DIRTY | PP_USE | pid);
-                    nfreepages--;
-                }
+    start = buddy_alloc(order);
+    if (start == NO_FRAME && frame_drain_cpus(true) > 0) {
+        // the run may be sitting in the cpu caches
+        start = buddy_alloc(order);
+    }
+    if (start != NO_FRAME) {
+        // mark all these pages as used, the run ends at PP_ALLOC_END
+        for (j=0; j<npages; j++) {
+            if (j == npages - 1) {
+                _coremap[start + j].cm_entry = (PP_ALLOC_END | PP_DIRTY | PP_USE);
             }
-            
-            ppage_addr = (paddr_t) (user_base_addr + (start * PAGE_SIZE));
-            break;
+            else {
+                _coremap[start + j].cm_entry = (PP_DIRTY | PP_USE);
+            }
+            _coremap[start + j].cm_refcount = 1;
         }
+        nbuddypages -= npages;
+
+        // the rest of the block was not asked for
+        buddy_free_range(start + npages, (1u << order) - npages);
+        pageout_kick();
+            
+        ppage_addr = (paddr_t) (user_base_addr + (start * PAGE_SIZE));
     }
     
     if (!acquired) {
         spinlock_release(&coremap_lock);
     }
-//    lock_release(cm_lock);
     
 //    kprintf("alloc_kpages %d, %x\n", npages, ret);
     return ppage_addr;
 }
 
+/*
+ *  free_frames - number of free frames, those in the cpu caches and
+ *  the ones zeroed ahead included. The caches are read without their
+ *  locks; it is a snapshot for the watermarks and statistics.
+ *
+ */
 static
-vaddr_t
-acquire_one_page (void)
+unsigned
+free_frames(void)
 {
-    unsigned start = next_free;
-    unsigned i;
-    uint32_t cme;
-    pid_t pid = curproc->pid;
-    pid <<= 6;
+    struct cpu *c;
+    unsigned i, n = nbuddypages;
+
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        n += c->c_nframes + c->c_nzframes;
+    }
+    return n;
+}
+
+/*
+ *  frame_drain_cpus - give the frames every cpu zeroed ahead back to
+ *  the free lists, and with ALL its cached free frames too, so that an
+ *  allocation that found them empty can retry. Returns the number of
+ *  frames given back. Called with coremap_lock held.
+ *
+ */
+static
+unsigned
+frame_drain_cpus(bool all)
+{
+    struct cpu *c;
+    unsigned i, n = 0;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        spinlock_acquire(&c->c_frame_lock);
+        while (c->c_nzframes > 0) {
+            buddy_free(c->c_zframes[--c->c_nzframes], 0);
+            nbuddypages++;
+            n++;
+        }
+        while (all && c->c_nframes > 0) {
+            buddy_free(c->c_frames[--c->c_nframes], 0);
+            nbuddypages++;
+            n++;
+        }
+        spinlock_release(&c->c_frame_lock);
+    }
+    return n;
+}
+
+/*
+ *  frame_get - take a free frame from this CPU's cache, refilling it
+ *  from the free lists in one batch when it runs dry, so that most
+ *  allocations don't touch coremap_lock. When the free lists are empty
+ *  too, the caches of all cpus are drained first. Returns a coremap
+ *  index or NO_FRAME.
+ *
+ */
+static
+unsigned
+frame_get(void)
+{
+    unsigned batch[CPU_FRAME_BATCH];
+    struct cpu *c;
+    unsigned idx, n;
+    int spl;
+
+    // stay on this cpu while we look at its cache
+    spl = splhigh();
+    c = curcpu->c_self;
+
+    spinlock_acquire(&c->c_frame_lock);
+    if (c->c_nframes > 0) {
+        idx = c->c_frames[--c->c_nframes];
+        c->c_frame_hits++;
+        spinlock_release(&c->c_frame_lock);
+        splx(spl);
+        return idx;
+    }
+    spinlock_release(&c->c_frame_lock);
 
+    // coremap_lock comes before c_frame_lock
     bool acquired = spinlock_do_i_hold(&coremap_lock);
-    
     if (!acquired) {
         spinlock_acquire(&coremap_lock);
     }
-    
-    for (i=0; i<last_page; i++) {
-        cme = _coremap[start];
-        if (IS_PPAGE_FREE(cme)) {
-            _coremap[start] = (PP_ALLOC_END | PP_DIRTY | PP_USE | pid);
-            nfreepages--;
-            
-            next_free = start + 1;
-            if (next_free >= last_page)
-                next_free = 0;
-                
+    if (free_frames() < PAGEOUT_LOW) {
+        // memory is short, frames zeroed ahead are better used by anyone
+        frame_drain_cpus(false);
+    }
+    for (n = 0; n < CPU_FRAME_BATCH; n++) {
+        idx = buddy_alloc(0);
+        if (idx == NO_FRAME && n == 0 && frame_drain_cpus(true) > 0) {
+            idx = buddy_alloc(0);
+        }
+        if (idx == NO_FRAME) {
             break;
         }
-
-        start++;
-        if (start >= last_page)
-            start = 0;
+        batch[n] = idx;
+        nbuddypages--;
     }
-    
-    if (start == last_page) {
-        // none free
-        start = 0;
+
+    // one for us, the rest for the cache
+    idx = NO_FRAME;
+    if (n > 0) {
+        idx = batch[--n];
+        spinlock_acquire(&c->c_frame_lock);
+        while (n > 0) {
+            c->c_frames[c->c_nframes++] = batch[--n];
+        }
+        c->c_frame_refills++;
+        spinlock_release(&c->c_frame_lock);
     }
-    
+    pageout_kick();
     if (!acquired) {
         spinlock_release(&coremap_lock);
     }
 
-    return (user_base_addr + (start * PAGE_SIZE));
+    splx(spl);
+    return idx;
 }
 
 /*
- *  alloc_kpages - allocate n contiguous physical pages
- *  return vaddr_t
+ *  frame_put - give free frame IDX to this CPU's cache, handing a batch
+ *  back to the free lists when it is full
  *
  */
-vaddr_t
-alloc_kpages (unsigned npages)
+static
+void
+frame_put(unsigned idx)
 {
-    paddr_t addr;
-//    pid_t pid = 0;
-    
-    if (!vm_initialized) {
-        addr = ram_stealmem(npages);
-    }
-    else {
-        addr = (npages == 1) ? acquire_one_page() : acquire_pages(npages);
-        
-        struct addrspace *as = proc_getas();
-        if (as != NULL) {
-            as->as_kpages += npages;
+    unsigned batch[CPU_FRAME_BATCH];
+    struct cpu *c;
+    unsigned i, n = 0;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+
+    spinlock_acquire(&c->c_frame_lock);
+    if (c->c_nframes == CPU_FRAME_CACHE) {
+        for (n = 0; n < CPU_FRAME_BATCH; n++) {
+            batch[n] = c->c_frames[--c->c_nframes];
         }
-//        KASSERT(pid > 0);
+        c->c_frame_drains++;
     }
-    
-    if (addr > 0) {
-        return PADDR_TO_KVADDR(addr);
+    c->c_frames[c->c_nframes++] = idx;
+    spinlock_release(&c->c_frame_lock);
+
+    if (n > 0) {
+        bool acquired = spinlock_do_i_hold(&coremap_lock);
+        if (!acquired) {
+            spinlock_acquire(&coremap_lock);
+        }
+        for (i = 0; i < n; i++) {
+            buddy_free(batch[i], 0);
+            nbuddypages++;
+        }
+        if (!acquired) {
+            spinlock_release(&coremap_lock);
+        }
     }
-    return 0;
+
+    splx(spl);
 }
 
 /*
- *  free_kpages - free pages starting at given physical addr
+ *  frame_get_zeroed - like frame_get, but the frame is zero-filled.
+ *  Frames zeroed by this CPU while idle are used first.
  *
  */
-void
-free_kpages (vaddr_t addr)
+static
+unsigned
+frame_get_zeroed(void)
+{
+    struct cpu *c;
+    unsigned idx = NO_FRAME;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+    spinlock_acquire(&c->c_frame_lock);
+    if (c->c_nzframes > 0) {
+        idx = c->c_zframes[--c->c_nzframes];
+    }
+    spinlock_release(&c->c_frame_lock);
+    splx(spl);
+
+    if (idx == NO_FRAME) {
+        idx = frame_get();
+        if (idx != NO_FRAME) {
+            bzero((void *) PADDR_TO_KVADDR(user_base_addr + (idx * PAGE_SIZE)), PAGE_SIZE);
+        }
+    }
+    return idx;
+}
+
+/*
+ *  vm_idle_zero - zero one free frame for this CPU's zeroed cache.
+ *  Called from cpu_idle with interrupts off; returns false if there
+ *  was nothing worth doing, so the CPU can go to sleep.
+ *
+ */
+bool
+vm_idle_zero(void)
+{
+    struct cpu *c;
+    unsigned idx;
+
+    if (!vm_initialized) {
+        return false;
+    }
+
+    c = curcpu->c_self;
+    // don't hoard frames when memory is short
+    if (c->c_nzframes == CPU_ZERO_CACHE || free_frames() < PAGEOUT_HIGH) {
+        return false;
+    }
+
+    idx = frame_get();
+    if (idx == NO_FRAME) {
+        return false;
+    }
+    bzero((void *) PADDR_TO_KVADDR(user_base_addr + (idx * PAGE_SIZE)), PAGE_SIZE);
+
+    // others only ever take frames out of the cache
+    spinlock_acquire(&c->c_frame_lock);
+    c->c_zframes[c->c_nzframes++] = idx;
+    spinlock_release(&c->c_frame_lock);
+    return true;
+}
+
+/*
+ *  rss_charge - count one more frame mapped by AS, and its peak.
+ *  Called with coremap_lock held.
+ *
+ */
+static
+void
+rss_charge(struct addrspace *as)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    as->as_rss++;
+    if (as->as_rss > as->as_maxrss) {
+        as->as_maxrss = as->as_rss;
+    }
+}
+
+/*
+ *  acquire_frame - allocate one frame, owned by AS at VADDR for user
+ *  pages, and zero-filled if ZERO is set. The frame is off the free
+ *  lists, so nobody else looks at its entry until the state says it is
+ *  in use; that is written last.
+ *
+ */
+static
+paddr_t
+acquire_frame (struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+    unsigned idx;
+
+    idx = zero ? frame_get_zeroed() : frame_get();
+    if (idx == NO_FRAME && textcache_reclaim()) {
+        // the last frames were cached text nobody runs
+        idx = zero ? frame_get_zeroed() : frame_get();
+    }
+    if (idx == NO_FRAME) {
+        // none free
+        return 0;
+    }
+
+    _coremap[idx].cm_refcount = 1;
+    _coremap[idx].cm_as = as;
+    _coremap[idx].cm_rmap = NULL;
+    membar_store_store();
+    _coremap[idx].cm_entry = ((vaddr & PAGE_FRAME) | PP_ALLOC_END | PP_DIRTY | PP_USE);
+
+    if (as != NULL) {
+        bool acquired = spinlock_do_i_hold(&coremap_lock);
+        if (!acquired) {
+            spinlock_acquire(&coremap_lock);
+        }
+        rss_charge(as);
+        if (!acquired) {
+            spinlock_release(&coremap_lock);
+        }
+    }
+
+    return (user_base_addr + (idx * PAGE_SIZE));
+}
+
+static
+vaddr_t
+acquire_one_page (void)
+{
+    return acquire_frame(NULL, 0, false);
+}
+
+/*
+ *  acquire_user_page - allocate a frame for user page VADDR of AS and
+ *  record the owner in the coremap
+ *
+ */
+static
+paddr_t
+acquire_user_page (struct addrspace *as, vaddr_t vaddr)
+{
+    return acquire_frame(as, vaddr, false);
+}
+
+/*
+ *  acquire_zeroed_user_page - acquire_user_page for a page that starts
+ *  out all zero
+ *
+ */
+static
+paddr_t
+acquire_zeroed_user_page (struct addrspace *as, vaddr_t vaddr)
+{
+    return acquire_frame(as, vaddr, true);
+}
+
+/*
+ *  alloc_kpages - allocate n contiguous physical pages
+ *  return vaddr_t
+ *
+ */
+vaddr_t
+alloc_kpages (unsigned npages)
+{
+    paddr_t addr;
+//    pid_t pid = 0;
+    
+    if (!vm_initialized) {
+        addr = ram_stealmem(npages);
+    }
+    else {
+        addr = (npages == 1) ? acquire_one_page() : acquire_pages(npages);
+//        KASSERT(pid > 0);
+    }
+    
+    if (addr > 0) {
+        return PADDR_TO_KVADDR(addr);
+    }
+    return 0;
+}
+
+/*
+ *  alloc_zeroed_kpage - allocate one zero-filled kernel page, taking
+ *  an idle-zeroed frame when there is one
+ *
+ */
+vaddr_t
+alloc_zeroed_kpage (void)
+{
+    paddr_t addr;
+
+    KASSERT(vm_initialized);
+    addr = acquire_frame(NULL, 0, true);
+    if (addr == 0) {
+        return 0;
+    }
+    return PADDR_TO_KVADDR(addr);
+}
+
+/*
+ *  free_kpages - free pages starting at given physical addr
+ *
+ */
+void
+free_kpages (vaddr_t addr)
 {
 //    unsigned entry_idx = (KVADDR_TO_PADDR(addr) & PAGE_FRAME) >> PAGE_OFFSET_BITS;
 //    KASSERT(entry_idx < last_page);
@@ -283,13 +988,22 @@ free_kpages (vaddr_t addr)
     }
 
     bool done = false;
+    unsigned npages = 0;
     do {    
-        done = IS_PPAGE_ALLOC_END(_coremap[entry_idx]);
-        _coremap[entry_idx] = PP_FREE;
-        entry_idx++;
-        nfreepages++;
+        done = IS_PPAGE_ALLOC_END(_coremap[entry_idx + npages].cm_entry);
+        _coremap[entry_idx + npages].cm_entry = PP_FREE;
+        _coremap[entry_idx + npages].cm_refcount = 0;
+        _coremap[entry_idx + npages].cm_as = NULL;
+        npages++;
+    }
+    while (!done && (entry_idx + npages < last_page));
+    if (npages == 1) {
+        frame_put(entry_idx);
+    }
+    else {
+        buddy_free_range(entry_idx, npages);
+        nbuddypages += npages;
     }
-    while (!done && (entry_idx < last_page));
    
     if (!acquired) {
         spinlock_release(&coremap_lock);
@@ -299,552 +1013,2708 @@ free_kpages (vaddr_t addr)
 
 }
 
+/*
+ *  rmap_reserve - allocate N reverse map entries for rmap_add into
+ *  *POOL. Done before coremap_lock is taken, which is held while the
+ *  entries get used.
+ *
+ */
 int
-duplicate_pagetable(struct pagetable* from, struct pagetable *to)
+rmap_reserve(struct rmap_entry **pool, unsigned n)
 {
-    KASSERT(from != NULL);
-    KASSERT(to != NULL);
-//    bool acquired = spinlock_do_i_hold(&coremap_lock);
-//    if (!acquired)
-//        spinlock_acquire(&coremap_lock);
-
-    paddr_t paddr_from;
-    paddr_t paddr_to;
-    paddr_t cmidx_from;
-    paddr_t cmidx_to;
-    
-    unsigned i;
-    for (i=0; i<NUM_PTE; i++) {
-        if (from->pt_entries[i] != 0) {
-            paddr_from = (from->pt_entries[i] & PAGE_FRAME);
-            cmidx_from = (from->pt_entries[i] - user_base_addr) / PAGE_SIZE;
-            if (cmidx_from >= last_page) {
-                continue;
-            }
-            
-            paddr_to = acquire_one_page();
-            paddr_to &= PAGE_FRAME;
-            if (paddr_to == 0) {
-                // no memory
-                kprintf("no memery\n");
-                return ENOMEM;
-            }
-
-            // copy the page content to the new page
-            memcpy((void*) KVADDR_TO_PADDR(paddr_to), (const void*) KVADDR_TO_PADDR(paddr_from), PAGE_SIZE);
-            
-            to->pt_entries[i] = (paddr_to | (from->pt_entries[i] & 0xFFF));
-            cmidx_to = (paddr_to - user_base_addr) / PAGE_SIZE;
-            _coremap[cmidx_to] = _coremap[cmidx_from];
+    struct rmap_entry *rm;
+
+    *pool = NULL;
+    while (n-- > 0) {
+        rm = kmalloc(sizeof(struct rmap_entry));
+        if (rm == NULL) {
+            rmap_release(*pool);
+            *pool = NULL;
+            return ENOMEM;
         }
+        rm->rm_next = *pool;
+        *pool = rm;
     }
-//    if (!acquired)
-//        spinlock_release(&coremap_lock);
     return 0;
 }
 
 /*
- *  vm_fault - handle vm faults
+ *  rmap_release - free the entries left over in POOL
  *
  */
-int
-vm_fault (int faulttype, vaddr_t faultaddress)
+void
+rmap_release(struct rmap_entry *pool)
 {
-    struct addrspace *as;
-    pid_t pid = curproc->pid;
-    
-    switch (faulttype) {
-        case VM_FAULT_READONLY:
-            KASSERT(faulttype == VM_FAULT_READONLY);
-            break;
+    struct rmap_entry *rm;
 
-        case VM_FAULT_READ:
-            break;
-            
-        case VM_FAULT_WRITE:
-            break;
-            
-        default:
-            return EINVAL;
+    while (pool != NULL) {
+        rm = pool;
+        pool = rm->rm_next;
+        kfree(rm);
     }
-    
-   	if (curproc == NULL) {
-		//
-		//  No process. This is probably a kernel fault early
-		// in boot. Return EFAULT so as to panic instead of
-		//  getting into an infinite faulting loop.
-		//
-		return EFAULT;
-	}
+}
 
-    lock_acquire(global_lock);
-   	as = proc_getas();
-	if (as == NULL) {
-		//
-		// No address space set up. This is probably also a
-		// kernel fault early in boot.
-		//
-        lock_release(global_lock);
-		return EFAULT;
-	}
-	
-	// check if the faultaddress within userspace
-	if (!as_is_valid_address(as, faultaddress)) {
-        lock_release(global_lock);	
-	    return SIGSEGV;
-	}
-	
-#if SWAP
-    if (nfreepages <= MIN_FREE_PAGES) {	
-        swapout();
+/*
+ *  rmap_add - record that page VADDR of AS maps frame IDX too, taking
+ *  an entry from *POOL. Called with coremap_lock held.
+ *
+ */
+static
+void
+rmap_add(unsigned idx, struct addrspace *as, vaddr_t vaddr, struct rmap_entry **pool)
+{
+    struct rmap_entry *rm;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    rss_charge(as);
+    if (_coremap[idx].cm_as == NULL) {
+        _coremap[idx].cm_as = as;
+        _coremap[idx].cm_entry = (vaddr & PAGE_FRAME) | (_coremap[idx].cm_entry & ~PAGE_FRAME);
+        return;
     }
-#endif
 
-    faultaddress &= PAGE_FRAME;  
+    rm = *pool;
+    KASSERT(rm != NULL);
+    *pool = rm->rm_next;
+    rm->rm_as = as;
+    rm->rm_vaddr = vaddr & PAGE_FRAME;
+    rm->rm_next = _coremap[idx].cm_rmap;
+    _coremap[idx].cm_rmap = rm;
+}
+
+/*
+ *  rmap_remove - forget that page VADDR of AS maps frame IDX. When the
+ *  first owner goes, the next one on the list takes its place. Called
+ *  with coremap_lock held.
+ *
+ */
+static
+void
+rmap_remove(unsigned idx, struct addrspace *as, vaddr_t vaddr)
+{
+    struct coremap_entry *cme = &_coremap[idx];
+    struct rmap_entry *rm, **prev;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(as->as_rss > 0);
+    as->as_rss--;
+    vaddr &= PAGE_FRAME;
+
+    if (cme->cm_as == as && (cme->cm_entry & PAGE_FRAME) == vaddr) {
+        rm = cme->cm_rmap;
+        if (rm == NULL) {
+            cme->cm_as = NULL;
+            return;
+        }
+        cme->cm_as = rm->rm_as;
+        cme->cm_entry = rm->rm_vaddr | (cme->cm_entry & ~PAGE_FRAME);
+        cme->cm_rmap = rm->rm_next;
+        kfree(rm);
+        return;
+    }
+
+    for (prev = &cme->cm_rmap; *prev != NULL; prev = &(*prev)->rm_next) {
+        rm = *prev;
+        if (rm->rm_as == as && rm->rm_vaddr == vaddr) {
+            *prev = rm->rm_next;
+            kfree(rm);
+            return;
+        }
+    }
+    panic("rmap_remove: frame %u is not mapped at 0x%x\n", idx, vaddr);
+}
+
+/*
+ *  free_user_page - drop the mapping of a user frame at page VADDR of
+ *  AS, the frame goes back to the free pool once no page table maps it
+ *  any more
+ *
+ */
+void
+free_user_page(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+    int32_t idx = ((paddr & PAGE_FRAME) - user_base_addr) / PAGE_SIZE;
+    if (idx < 0 || idx >= (int) last_page) {
+        return;
+    }
+    if ((paddr & PAGE_FRAME) == zero_frame) {
+        return;
+    }
 
-    int err;
-    pagetable_t pt_entry;
-    
     bool acquired = spinlock_do_i_hold(&coremap_lock);
     if (!acquired) {
         spinlock_acquire(&coremap_lock);
     }
 
-    bool as_acquired = spinlock_do_i_hold(&as->as_lock);
-    if (!as_acquired) {
-        spinlock_acquire(&as->as_lock);
+    // let a pageout of this frame finish first
+    while (_coremap[idx].cm_busy) {
+        wchan_sleep(coremap_wchan, &coremap_lock);
     }
 
-    err = as_get_pt_entry(as, faultaddress, &pt_entry);
-    if (err) {
-        if (!as_acquired) {
-            spinlock_release(&as->as_lock);
-        }
-        
-        if (!acquired) {
-            spinlock_release(&coremap_lock);
+    KASSERT(_coremap[idx].cm_refcount > 0);
+    _coremap[idx].cm_refcount--;
+    rmap_remove(idx, as, vaddr);
+    if (_coremap[idx].cm_refcount == 0) {
+        KASSERT(_coremap[idx].cm_as == NULL);
+        if (IS_PPAGE_KSM(_coremap[idx].cm_entry)) {
+            ksm_unlink(idx);
         }
-   		lock_release(global_lock);
-    
-        return err;
+        _coremap[idx].cm_entry = PP_FREE;
+        frame_put(idx);
     }
-    
 
-#if SWAP
-    err = swapin(faultaddress, pid);
-    if (err == SWAPIN_NO_MEM) {
-        panic("We did a swap out earlier...");
+    if (!acquired) {
+        spinlock_release(&coremap_lock);
     }
-#endif
+}
 
-    if (pt_entry == 0) {
-        
-        paddr_t ppage = acquire_one_page();
-        if (ppage == 0) {
-            if (!as_acquired) {
-                spinlock_release(&as->as_lock);
-            }
-        
-            if (!acquired) {
-                spinlock_release(&coremap_lock);
-            }
-            
-       		lock_release(global_lock);
-            return ENOMEM;
-        }
-        
-        as->as_vpages++;
-        // update pagetable entry with the page address in RAM
-        
-        pt_entry = ((ppage & PAGE_FRAME) | PT_PRESENT_MASK | PT_DIRTY_MASK);
-        as_set_pt_entry(as, faultaddress, pt_entry);
-        
-        unsigned cmidx = ((ppage & PAGE_FRAME) - user_base_addr) / PAGE_SIZE;
-        _coremap[cmidx] |= (faultaddress);
+/*
+ *  vm_shm_alloc - allocate a zero-filled frame for a shared memory
+ *  object, with the object's reference. Returns 0 if there is none.
+ *
+ */
+paddr_t
+vm_shm_alloc(void)
+{
+    paddr_t paddr;
+    unsigned idx;
 
+    paddr = acquire_frame(NULL, 0, true);
+    if (paddr == 0) {
+        return 0;
     }
-    else {
-        pt_entry = (pt_entry & PAGE_FRAME) | PT_PRESENT_MASK | PT_USED_MASK;
-        as_set_pt_entry(as, faultaddress, pt_entry);
-    }
+    idx = (paddr - user_base_addr) / PAGE_SIZE;
 
-    uint32_t entryhi, entrylo;
-    
-    entryhi = faultaddress | pid << 6;
-    
-    bool writeable = true;
-    if (faultaddress >= as->as_code_base && faultaddress < as->as_code_top) {
-        writeable = (as->as_code_permission & AS_WRITEABLE);
+    // not owned by anybody yet, so pageout doesn't look at it
+    spinlock_acquire(&coremap_lock);
+    _coremap[idx].cm_entry |= PP_SHM;
+    spinlock_release(&coremap_lock);
+    return paddr;
+}
+
+/*
+ *  vm_shm_ref - take another reference on shared memory frame PADDR,
+ *  for a page table about to map it
+ *
+ */
+void
+vm_shm_ref(paddr_t paddr)
+{
+    unsigned idx = (paddr - user_base_addr) / PAGE_SIZE;
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(IS_PPAGE_SHM(_coremap[idx].cm_entry));
+    KASSERT(_coremap[idx].cm_refcount > 0);
+    _coremap[idx].cm_refcount++;
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ *  vm_shm_release - drop the object's reference on shared memory frame
+ *  PADDR. Mappings of the frame keep it until they go too.
+ *
+ */
+void
+vm_shm_release(paddr_t paddr)
+{
+    unsigned idx = (paddr - user_base_addr) / PAGE_SIZE;
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(IS_PPAGE_SHM(_coremap[idx].cm_entry));
+    KASSERT(_coremap[idx].cm_refcount > 0);
+    _coremap[idx].cm_refcount--;
+    if (_coremap[idx].cm_refcount == 0) {
+        KASSERT(_coremap[idx].cm_as == NULL);
+        _coremap[idx].cm_entry = PP_FREE;
+        frame_put(idx);
+    }
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ *  shm_map - find the frame of page PAGE of shared memory object V for
+ *  page VADDR of AS, which becomes one of its owners
+ *
+ */
+static
+int
+shm_map(struct addrspace *as, vaddr_t vaddr, struct vnode *v, unsigned page, paddr_t *ret)
+{
+    struct rmap_entry *pool;
+    paddr_t paddr;
+    int result;
+
+    // in case the frame has an owner already
+    result = rmap_reserve(&pool, 1);
+    if (result) {
+        return result;
     }
-    else if (faultaddress >= as->as_data_base && faultaddress < as->as_data_top) {
-        writeable = (as->as_data_permission & AS_WRITEABLE);
+    result = shm_getpage(v, page, &paddr);
+    if (result) {
+        rmap_release(pool);
+        return result;
     }
-    
-    if (faulttype == VM_FAULT_WRITE) {
-        if (writeable) {
-            entrylo = (pt_entry & PAGE_FRAME) | TLBLO_VALID | TLBLO_DIRTY;
+
+    spinlock_acquire(&coremap_lock);
+    rmap_add((paddr - user_base_addr) / PAGE_SIZE, as, vaddr, &pool);
+    spinlock_release(&coremap_lock);
+
+    rmap_release(pool);
+    *ret = paddr;
+    return 0;
+}
+
+/*
+ *  duplicate_pagetable - share every resident page of FROM with TO
+ *  copy-on-write. Both entries lose write access; the first write
+ *  through either of them takes a VM_FAULT_READONLY fault and copies
+ *  just that page (see copy_on_write). Pages of shared memory objects
+ *  and of shared file mappings are simply mapped by both. TO maps the pages from BASE on
+ *  in TO_AS, which becomes another owner of each frame, with reverse
+ *  map entries from *POOL. Returns the number of entries copied.
+ *
+ */
+unsigned
+duplicate_pagetable(struct addrspace *to_as, vaddr_t base,
+                    struct pagetable* from, struct pagetable *to,
+                    struct rmap_entry **pool)
+{
+    KASSERT(from != NULL);
+    KASSERT(to != NULL);
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    pagetable_t pte;
+    unsigned cmidx;
+    unsigned i, n = 0;
+
+    for (i=0; i<NUM_PTE; i++) {
+        pte = from->pt_entries[i];
+        if (!(pte & PT_PRESENT_MASK)) {
+            // untouched, or paged out and copied by as_copy
+            continue;
         }
-        else {
-            lock_release(global_lock);
-            return EPERM;
+
+        cmidx = ((pte & PAGE_FRAME) - user_base_addr) / PAGE_SIZE;
+        if (cmidx >= last_page) {
+            continue;
+        }
+
+        // the zero frame is not reference counted
+        if ((pte & PAGE_FRAME) != zero_frame) {
+            KASSERT(_coremap[cmidx].cm_refcount > 0);
+            _coremap[cmidx].cm_refcount++;
+            rmap_add(cmidx, to_as, base + i * PAGE_SIZE, pool);
+        }
+
+        // shared memory and shared file pages stay writeable, both
+        // see each other's stores
+        if (!(pte & PT_SHARED_MASK)) {
+            pte |= PT_COW_MASK;
+            from->pt_entries[i] = pte;
         }
+        // the swap slot a cached page came from is the parent's
+        to->pt_entries[i] = pte & ~PT_SWAPCACHE_MASK;
+        n++;
     }
-    else {
-        if (writeable) {
-            entrylo = (pt_entry & PAGE_FRAME) | TLBLO_VALID | TLBLO_DIRTY;
+
+    return n;
+}
+
+/*
+ *  copy_on_write - give the faulting address space a private copy of
+ *  a frame shared by fork. If nobody else maps the frame any more we
+ *  simply keep it. Called with as_vm_lock held, so our own entry stays
+ *  put; coremap_lock is only taken to look at and update the sharing,
+ *  the new frame is filled without it.
+ *
+ */
+static
+int
+copy_on_write(struct addrspace *as, vaddr_t vaddr, pagetable_t *pt_entry)
+{
+    paddr_t paddr_from = (*pt_entry & PAGE_FRAME);
+    paddr_t paddr_to;
+    unsigned cmidx_from;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    if (paddr_from == zero_frame) {
+        // first write to a page that was only read so far
+        paddr_to = acquire_zeroed_user_page(as, vaddr);
+        if (paddr_to == 0) {
+            return ENOMEM;
         }
-        else {
-            entrylo = (pt_entry & PAGE_FRAME) | TLBLO_VALID;
+        *pt_entry = (paddr_to & PAGE_FRAME) | (*pt_entry & ~PAGE_FRAME);
+        goto done;
+    }
+
+    cmidx_from = (paddr_from - user_base_addr) / PAGE_SIZE;
+    KASSERT(cmidx_from < last_page);
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(_coremap[cmidx_from].cm_refcount > 0);
+    if (_coremap[cmidx_from].cm_refcount == 1) {
+        goto sole;
+    }
+    spinlock_release(&coremap_lock);
+
+    // our reference keeps the frame, and nobody can write to it
+    paddr_to = acquire_user_page(as, vaddr);
+    if (paddr_to == 0) {
+        return ENOMEM;
+    }
+    memcpy((void *) PADDR_TO_KVADDR(paddr_to), (const void *) PADDR_TO_KVADDR(paddr_from), PAGE_SIZE);
+
+    spinlock_acquire(&coremap_lock);
+    if (_coremap[cmidx_from].cm_refcount == 1) {
+        // the others went away meanwhile, the copy was for nothing
+        free_user_page(paddr_to, as, vaddr);
+        goto sole;
+    }
+    _coremap[cmidx_from].cm_refcount--;
+    rmap_remove(cmidx_from, as, vaddr);
+    spinlock_release(&coremap_lock);
+
+    *pt_entry = (paddr_to & PAGE_FRAME) | (*pt_entry & ~PAGE_FRAME);
+    goto done;
+
+sole:
+    // we are the only one left
+    KASSERT(_coremap[cmidx_from].cm_as == as);
+    if (IS_PPAGE_KSM(_coremap[cmidx_from].cm_entry)) {
+        // about to be written, it can't take more owners
+        ksm_unlink(cmidx_from);
+    }
+    spinlock_release(&coremap_lock);
+
+done:
+    *pt_entry &= ~PT_COW_MASK;
+    *pt_entry |= PT_DIRTY_MASK;
+    return 0;
+}
+
+/*
+ *  frame_nmaps - number of page tables mapping frame IDX, which is its
+ *  reference count less the one of the text cache
+ *
+ */
+static
+unsigned
+frame_nmaps(unsigned idx)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    return _coremap[idx].cm_refcount - (IS_PPAGE_TEXT(_coremap[idx].cm_entry) ? 1 : 0);
+}
+
+static
+unsigned
+textcache_hash(const struct textkey *key)
+{
+    return (((vaddr_t) key->tk_vnode >> 4) ^ ((uint32_t) key->tk_offset >> PAGE_OFFSET_BITS) ^
+            key->tk_head) & (TEXT_HASH_SIZE - 1);
+}
+
+/*
+ *  textcache_lookup - the cache entry for pages holding KEY, or NULL.
+ *  Waits for a frame that is being paged out, it may not stay.
+ *  Called with coremap_lock held.
+ *
+ */
+static
+struct textpage *
+textcache_lookup(const struct textkey *key)
+{
+    struct textpage *tp;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    while (1) {
+        for (tp = textcache[textcache_hash(key)]; tp != NULL; tp = tp->tp_next) {
+            if (tp->tp_key.tk_vnode == key->tk_vnode &&
+                tp->tp_key.tk_offset == key->tk_offset &&
+                tp->tp_key.tk_head == key->tk_head &&
+                tp->tp_key.tk_len == key->tk_len) {
+                break;
+            }
         }
+        if (tp == NULL || !_coremap[tp->tp_frame].cm_busy) {
+            return tp;
+        }
+        wchan_sleep(coremap_wchan, &coremap_lock);
     }
-    
+}
+
+/*
+ *  textcache_drop - take TP out of the cache and give up the cache's
+ *  reference on its frame, which is freed if nobody maps it. The vnode
+ *  reference goes with TP onto textcache_dead. Called with
+ *  coremap_lock held.
+ *
+ */
+static
+void
+textcache_drop(struct textpage *tp)
+{
+    struct coremap_entry *cme = &_coremap[tp->tp_frame];
+    struct textpage **prev;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(cme->cm_text == tp && !cme->cm_busy);
+
+    for (prev = &textcache[textcache_hash(&tp->tp_key)]; *prev != tp;
+         prev = &(*prev)->tp_next) {
+        KASSERT(*prev != NULL);
+    }
+    *prev = tp->tp_next;
+    tp->tp_next = textcache_dead;
+    textcache_dead = tp;
+    tp->tp_key.tk_vnode->vn_textpages--;
+    ntextpages--;
+
+    cme->cm_entry &= ~(PP_TEXT | PP_TEXT_USED);
+    cme->cm_text = NULL;
+    KASSERT(cme->cm_refcount > 0);
+    cme->cm_refcount--;
+    if (cme->cm_refcount == 0) {
+        KASSERT(cme->cm_as == NULL);
+        cme->cm_entry = PP_FREE;
+        frame_put(tp->tp_frame);
+    }
+}
+
+/*
+ *  textcache_reap - let go of the vnodes of dropped cache entries. This
+ *  may reclaim a vnode, so it is called without spinlocks held.
+ *
+ */
+static
+void
+textcache_reap(void)
+{
+    struct textpage *tp, *list;
+
+    if (textcache_dead == NULL) {
+        return;
+    }
+    spinlock_acquire(&coremap_lock);
+    list = textcache_dead;
+    textcache_dead = NULL;
+    spinlock_release(&coremap_lock);
+
+    while (list != NULL) {
+        tp = list;
+        list = tp->tp_next;
+        VOP_DECREF(tp->tp_key.tk_vnode);
+        kfree(tp);
+    }
+}
+
+/*
+ *  textcache_reclaim - free the frame of one cached text page that no
+ *  process maps, for a frame allocator that found none left. Returns
+ *  false if there is no such page.
+ *
+ */
+static
+bool
+textcache_reclaim(void)
+{
+    struct textpage *tp;
+    unsigned n;
+    bool found = false;
+
+    bool acquired = spinlock_do_i_hold(&coremap_lock);
+    if (!acquired) {
+        spinlock_acquire(&coremap_lock);
+    }
+
+    for (n = 0; n < TEXT_HASH_SIZE && !found && ntextpages > 0; n++) {
+        for (tp = textcache[textcache_hand]; tp != NULL; tp = tp->tp_next) {
+            if (_coremap[tp->tp_frame].cm_refcount == 1 && !_coremap[tp->tp_frame].cm_busy) {
+                textcache_drop(tp);
+                found = true;
+                break;
+            }
+        }
+        textcache_hand = (textcache_hand + 1) & (TEXT_HASH_SIZE - 1);
+    }
+
     if (!acquired) {
         spinlock_release(&coremap_lock);
     }
-        
-    if (!as_acquired) {
-        spinlock_release(&as->as_lock);
+    return found;
+}
+
+/*
+ *  textcache_map - find the frame the text cache has for page VADDR of
+ *  AS, which holds KEY, reading it from the file on a miss, which
+ *  *READ tells. The frame is returned in RET with one more reference,
+ *  for AS, which becomes one of its owners.
+ *
+ */
+static
+int
+textcache_map(struct addrspace *as, vaddr_t vaddr, const struct textkey *key, paddr_t *ret,
+              bool *read)
+{
+    struct rmap_entry *pool;
+    struct textpage *tp, *newtp = NULL;
+    paddr_t paddr;
+    unsigned idx;
+    int result;
+
+    // in case the frame has an owner already
+    result = rmap_reserve(&pool, 1);
+    if (result) {
+        return result;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    *read = false;
+    tp = textcache_lookup(key);
+    if (tp != NULL) {
+        text_hits++;
+        goto share;
+    }
+    spinlock_release(&coremap_lock);
+
+    // read it into a frame of our own and offer that to the cache
+    newtp = kmalloc(sizeof(struct textpage));
+    if (newtp == NULL) {
+        rmap_release(pool);
+        return ENOMEM;
+    }
+    paddr = acquire_user_page(as, vaddr);
+    if (paddr == 0) {
+        kfree(newtp);
+        rmap_release(pool);
+        return ENOMEM;
+    }
+    result = as_load_page(as, vaddr, paddr);
+    if (result) {
+        free_user_page(paddr, as, vaddr);
+        kfree(newtp);
+        rmap_release(pool);
+        return result;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    text_misses++;
+    *read = true;
+    tp = textcache_lookup(key);
+    if (tp != NULL) {
+        // somebody else read it in meanwhile
+        free_user_page(paddr, as, vaddr);
+        goto share;
+    }
+
+    idx = (paddr - user_base_addr) / PAGE_SIZE;
+    newtp->tp_key = *key;
+    newtp->tp_frame = idx;
+    newtp->tp_next = textcache[textcache_hash(key)];
+    textcache[textcache_hash(key)] = newtp;
+    VOP_INCREF(key->tk_vnode);
+    key->tk_vnode->vn_textpages++;
+    ntextpages++;
+
+    _coremap[idx].cm_refcount++;
+    _coremap[idx].cm_entry |= PP_TEXT;
+    _coremap[idx].cm_text = newtp;
+    spinlock_release(&coremap_lock);
+
+    rmap_release(pool);
+    *ret = paddr;
+    return 0;
+
+share:
+    idx = tp->tp_frame;
+    _coremap[idx].cm_refcount++;
+    _coremap[idx].cm_entry |= PP_TEXT_USED;
+    rmap_add(idx, as, vaddr, &pool);
+    spinlock_release(&coremap_lock);
+
+    if (newtp != NULL) {
+        kfree(newtp);
+    }
+    rmap_release(pool);
+    *ret = user_base_addr + (idx * PAGE_SIZE);
+    return 0;
+}
+
+/*
+ *  vm_textcache_purge - drop the cached pages of V, which has just been
+ *  written to. Processes mapping them keep their frames, but programs
+ *  started from now on read the file again.
+ *
+ */
+void
+vm_textcache_purge(struct vnode *v)
+{
+    struct textpage *tp, *next;
+    unsigned b;
+
+    if (v->vn_textpages == 0) {
+        return;
+    }
+
+    spinlock_acquire(&coremap_lock);
+restart:
+    for (b = 0; b < TEXT_HASH_SIZE && v->vn_textpages > 0; b++) {
+        for (tp = textcache[b]; tp != NULL; tp = next) {
+            next = tp->tp_next;
+            if (tp->tp_key.tk_vnode != v) {
+                continue;
+            }
+            if (_coremap[tp->tp_frame].cm_busy) {
+                wchan_sleep(coremap_wchan, &coremap_lock);
+                goto restart;
+            }
+            textcache_drop(tp);
+        }
+    }
+    spinlock_release(&coremap_lock);
+
+    textcache_reap();
+}
+
+/*
+ *  pte_entrylo - the TLB entrylo for page table entry PTE in a region
+ *  that may be WRITEABLE
+ *
+ */
+static
+uint32_t
+pte_entrylo(pagetable_t pte, bool writeable)
+{
+    uint32_t entrylo = (pte & PAGE_FRAME) | TLBLO_VALID;
+
+    // shared pages stay read-only until someone writes to them, and
+    // clean ones until we have noted that they are dirty
+    if (writeable && !(pte & PT_COW_MASK) && (pte & PT_DIRTY_MASK)) {
+        entrylo |= TLBLO_DIRTY;
+    }
+    return entrylo;
+}
+
+/*
+ *  faultaround_collect - find the resident pages of the aligned block
+ *  of vm_faultaround pages around FAULTADDRESS, within its region, and
+ *  store their addresses and page table entries in VADDRS and PTES.
+ *  Returns how many there are. The caller holds as_lock.
+ *
+ */
+static
+unsigned
+faultaround_collect(struct addrspace *as, vaddr_t faultaddress,
+                    vaddr_t *vaddrs, pagetable_t *ptes)
+{
+    struct vm_region *r;
+    vaddr_t start, end, va;
+    pagetable_t pte;
+    unsigned window = vm_faultaround;
+    unsigned n = 0;
+
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+    if (window <= 1) {
+        return 0;
+    }
+    r = as_find_region(as, faultaddress);
+    if (r == NULL) {
+        return 0;
+    }
+
+    start = faultaddress & ~(window * PAGE_SIZE - 1);
+    end = start + window * PAGE_SIZE;
+    if (start < r->vr_base) {
+        start = r->vr_base;
+    }
+    if (end > r->vr_top || end < start) {
+        end = r->vr_top;
+    }
+
+    for (va = start; va < end; va += PAGE_SIZE) {
+        if (va == faultaddress) {
+            continue;
+        }
+        // pages in swap or not touched yet still fault one by one
+        pte = as_peek_pt_entry(as, va);
+        if (pte & PT_PRESENT_MASK) {
+            vaddrs[n] = va;
+            ptes[n] = pte;
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ *  vm_set_faultaround - set how many pages around a fault get loaded
+ *  into the TLB. NPAGES is a power of two up to FAULT_AROUND_MAX, 1
+ *  turns fault-around off.
+ *
+ */
+int
+vm_set_faultaround(unsigned npages)
+{
+    if (npages == 0 || npages > FAULT_AROUND_MAX || (npages & (npages - 1))) {
+        return EINVAL;
+    }
+    vm_faultaround = npages;
+    return 0;
+}
+
+/*
+ *  vm_fault - handle vm faults
+ *
+ *  Faults are serialized per address space by as_vm_lock, which may be
+ *  held across page-in I/O. The page table words themselves are only
+ *  touched under the as_lock spinlock and frames are handed out under
+ *  coremap_lock, so faults in different address spaces run in parallel.
+ *
+ */
+int
+vm_fault (int faulttype, vaddr_t faultaddress)
+{
+    struct addrspace *as;
+    
+    switch (faulttype) {
+        case VM_FAULT_READONLY:
+            KASSERT(faulttype == VM_FAULT_READONLY);
+            break;
+
+        case VM_FAULT_READ:
+            break;
+            
+        case VM_FAULT_WRITE:
+            break;
+            
+        default:
+            return EINVAL;
+    }
+    
+   	if (curproc == NULL) {
+		//
+		//  No process. This is probably a kernel fault early
+		// in boot. Return EFAULT so as to panic instead of
+		//  getting into an infinite faulting loop.
+		//
+		return EFAULT;
+	}
+
+   	as = proc_getas();
+	if (as == NULL) {
+		//
+		// No address space set up. This is probably also a
+		// kernel fault early in boot.
+		//
+		return EFAULT;
+	}
+	
+	// check if the faultaddress within userspace, a fault just below
+	// the stack grows it
+	if (!as_is_valid_address(as, faultaddress)) {
+	    lock_acquire(as->as_vm_lock);
+	    int grown = as_grow_stack(as, faultaddress);
+	    lock_release(as->as_vm_lock);
+	    if (grown) {
+	        return SIGSEGV;
+	    }
+	}
+	
+    faultaddress &= PAGE_FRAME;  
+
+    unsigned permission = as_get_permission(as, faultaddress);
+    bool writeable = (permission & AS_WRITEABLE);
+    if (faulttype != VM_FAULT_READ && !writeable) {
+        return EFAULT;
+    }
+    // PROT_NONE, or mapped without PROT_READ
+    if (faulttype == VM_FAULT_READ && !(permission & AS_READABLE)) {
+        return EFAULT;
+    }
+
+    lock_acquire(as->as_vm_lock);
+
+#if SWAP
+    // the pageout thread has fallen behind, reclaim a frame ourselves
+    if (free_frames() <= MIN_FREE_PAGES) {	
+        swapout();
+    }
+#endif
+
+    int err;
+    pagetable_t pt_entry;
+    struct textkey key;
+    struct vnode *shmobj;
+    unsigned shmpage;
+    struct vm_region *r;
+    bool sharedfile;
+    bool remapped = false;
+    // what the fault took, for getrusage: a page that is mapped
+    // already only has to go back into the TLB
+    __u32 *counter = &as->as_tlbrefills;
+
+    // vnodes the text cache let go of since
+    textcache_reap();
+
+    // the pages of a shared file mapping stay shared across fork, like
+    // those of shared memory, so stores reach everybody mapping them
+    r = as_find_region(as, faultaddress);
+    if (r == NULL) {
+        // unmapped since we looked
+        err = EFAULT;
+        goto fail;
+    }
+    sharedfile = (r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED));
+    
+    spinlock_acquire(&as->as_lock);
+    err = as_get_pt_entry(as, faultaddress, &pt_entry);
+    spinlock_release(&as->as_lock);
+    if (err) {
+        goto fail;
+    }
+    
+
+    if (pt_entry == 0 && as_page_is_shm(as, faultaddress, &shmobj, &shmpage)) {
+        // shared memory: map the object's frame, every store goes
+        // straight to it
+        paddr_t ppage;
+        err = shm_map(as, faultaddress, shmobj, shmpage, &ppage);
+        if (err) {
+            goto fail;
+        }
+        counter = &as->as_minflt;
+        pt_entry = (ppage | PT_VALID_MASK | PT_PRESENT_MASK | PT_DIRTY_MASK | PT_SHARED_MASK);
+    }
+    else if (pt_entry == 0 && !as_page_has_file_data(as, faultaddress)) {
+        if (faulttype == VM_FAULT_READ && !sharedfile) {
+            // reading an untouched zero page: share the zero frame
+            // until somebody writes to it
+            pt_entry = (zero_frame | PT_VALID_MASK | PT_PRESENT_MASK | PT_COW_MASK);
+        }
+        else {
+            paddr_t ppage = acquire_zeroed_user_page(as, faultaddress);
+            if (ppage == 0) {
+                err = ENOMEM;
+                goto fail;
+            }
+            pt_entry = (ppage | PT_VALID_MASK | PT_PRESENT_MASK | PT_DIRTY_MASK);
+            if (sharedfile) {
+                pt_entry |= PT_SHARED_MASK;
+            }
+        }
+        counter = &as->as_minflt;
+    }
+    else if (pt_entry == 0 && as_page_is_text(as, faultaddress, &key)) {
+        // program text: share the frame everybody running the program
+        // maps, it stays clean
+        paddr_t ppage;
+        bool read;
+        err = textcache_map(as, faultaddress, &key, &ppage, &read);
+        if (err) {
+            goto fail;
+        }
+        counter = read ? &as->as_majflt : &as->as_minflt;
+        pt_entry = (ppage | PT_VALID_MASK | PT_PRESENT_MASK | PT_COW_MASK);
+    }
+    else if (pt_entry == 0) {
+        
+        paddr_t ppage = acquire_user_page(as, faultaddress);
+        if (ppage == 0) {
+            err = ENOMEM;
+            goto fail;
+        }
+        counter = &as->as_majflt;
+        
+        // first touch: read the page from the executable. This may
+        // sleep; as_vm_lock keeps other faults on this address space
+        // away meanwhile.
+        err = as_load_page(as, faultaddress, ppage);
+        if (err) {
+            free_user_page(ppage, as, faultaddress);
+            goto fail;
+        }
+
+        // update pagetable entry with the page address in RAM. A file
+        // page that is only read stays clean, so it can be dropped
+        // instead of swapped.
+        pt_entry = (ppage | PT_VALID_MASK | PT_PRESENT_MASK);
+        if (faulttype != VM_FAULT_READ || r->vr_type != VR_FILE) {
+            pt_entry |= PT_DIRTY_MASK;
+        }
+        if (sharedfile) {
+            pt_entry |= PT_SHARED_MASK;
+        }
+    }
+    else if (!(pt_entry & PT_PRESENT_MASK)) {
+        // the page was paged out
+#if SWAP
+        paddr_t ppage;
+        bool cached;
+        err = swapin(as, faultaddress, &ppage, &cached);
+        if (err) {
+            goto fail;
+        }
+        // clean until written if the slot keeps a copy, a page that
+        // came from the compressed pool has none left
+        pt_entry = (ppage | PT_VALID_MASK | PT_PRESENT_MASK);
+        pt_entry |= cached ? PT_SWAPCACHE_MASK : PT_DIRTY_MASK;
+        // only a page that was on the disk had to be read
+        counter = cached ? &as->as_majflt : &as->as_minflt;
+#else
+        panic("vm_fault: page 0x%x not present without swap\n", faultaddress);
+#endif
+    }
+    else if ((pt_entry & PT_COW_MASK) && faulttype != VM_FAULT_READ) {
+        // first write to a page shared by fork
+        err = copy_on_write(as, faultaddress, &pt_entry);
+        if (err) {
+            goto fail;
+        }
+        remapped = true;
+        counter = &as->as_minflt;
+    }
+    else if (faulttype != VM_FAULT_READ && !(pt_entry & PT_DIRTY_MASK)) {
+        // first store to a clean file or swap cache page
+        pt_entry |= PT_DIRTY_MASK;
+        counter = &as->as_minflt;
+    }
+
+#if SWAP
+    if (faulttype != VM_FAULT_READ && (pt_entry & PT_SWAPCACHE_MASK)) {
+        // the copy in swap is stale from now on
+        remove_swap_entry(as, faultaddress);
+        pt_entry &= ~PT_SWAPCACHE_MASK;
+        pt_entry |= PT_DIRTY_MASK;
+    }
+#endif
+
+    pt_entry |= PT_PRESENT_MASK | PT_USED_MASK;
+
+    // neighbours stay resident while we hold as_vm_lock, pageout has
+    // to take it before evicting any of them
+    vaddr_t around[FAULT_AROUND_MAX];
+    pagetable_t around_ptes[FAULT_AROUND_MAX];
+    unsigned naround, i;
+
+    spinlock_acquire(&as->as_lock);
+    as_set_pt_entry(as, faultaddress, pt_entry);
+    naround = faultaround_collect(as, faultaddress, around, around_ptes);
+    spinlock_release(&as->as_lock);
+
+    if (remapped) {
+        // other CPUs may still map the read-only frame
+        vm_tlbshootdown_page(as, faultaddress);
+    }
+
+    uint32_t entryhi, entrylo, asid;
+    
+    // the TLB is per-cpu, masking interrupts is all the locking it needs
+    int spl = splhigh();
+
+    // our ASID may have been dropped since we were switched to
+    asid = vm_activate(as) << TLBHI_PIDSHIFT;
+
+    // preload the neighbours first, so tlb_random can't evict the
+    // entry we came for. Entries already in the TLB are left alone.
+    for (i = 0; i < naround; i++) {
+        entryhi = around[i] | asid;
+        if (tlb_probe(entryhi, 0) < 0) {
+            tlb_random(entryhi, pte_entrylo(around_ptes[i], writeable));
+            curcpu->c_vm_faultaround++;
+        }
+    }
+    curcpu->c_vm_faults++;
+    (*counter)++;
+
+    entryhi = faultaddress | asid;
+    entrylo = pte_entrylo(pt_entry, writeable);
+
+    int idx = tlb_probe(entryhi, 0);
+    if (idx >= 0) {
+        tlb_write(entryhi, entrylo, idx);
+    }
+    else {
+        // entry not in TLB, write to a randon location
+        tlb_random(entryhi, entrylo);
+    }
+
+    splx(spl);
+
+    lock_release(as->as_vm_lock);
+    return 0;
+
+fail:
+    // as_get_pt_entry may have made a table for nothing
+    as_trim_pagetable(as, faultaddress);
+    lock_release(as->as_vm_lock);
+    return err;
+}
+
+/*
+ *  vm_commit - reserve NPAGES pages of RAM and swap for heap pages that
+ *  will only get a frame when first touched. Fails with ENOMEM once
+ *  the heaps of all processes could no longer be backed.
+ *
+ */
+int
+vm_commit(unsigned npages)
+{
+    unsigned limit = last_page;
+
+#if SWAP
+    limit += swap_nslots;
+#endif
+
+    spinlock_acquire(&coremap_lock);
+    if (npages > limit - ncommitted) {
+        spinlock_release(&coremap_lock);
+        return ENOMEM;
+    }
+    ncommitted += npages;
+    spinlock_release(&coremap_lock);
+    return 0;
+}
+
+/*
+ *  vm_uncommit - give back NPAGES pages reserved with vm_commit
+ *
+ */
+void
+vm_uncommit(unsigned npages)
+{
+    spinlock_acquire(&coremap_lock);
+    KASSERT(ncommitted >= npages);
+    ncommitted -= npages;
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ *  alloc_sbrk_pages - grow the heap by NPAGES. Only the commit is taken
+ *  here, vm_fault hands out the frames as the pages get touched. The
+ *  caller holds the address space's as_vm_lock.
+ *
+ */
+int 
+alloc_sbrk_pages(unsigned npages)
+{
+    struct addrspace *as = proc_getas();
+    int err;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    err = vm_commit(npages);
+    if (err) {
+        return err;
+    }
+    as->as_committed += npages;
+    as->as_heap->vr_top += npages * PAGE_SIZE;
+    return 0;
+}
+
+/*
+ *  free_sbrk_pages - shrink the heap by NPAGES. The caller holds the
+ *  address space's as_vm_lock.
+ *
+ */
+int 
+free_sbrk_pages(unsigned npages)
+{
+    struct addrspace *as = proc_getas();
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+    
+    if (npages > 0) {
+        as->as_heap->vr_top -= npages * PAGE_SIZE;
+        vm_unmap(as, as->as_heap->vr_top, npages);
+        as->as_committed -= npages;
+        vm_uncommit(npages);
+    }
+    
+    return 0;
+}
+
+/*
+ *  vm_unmap - unmap NPAGES pages of AS from START on and drop the
+ *  frames and swap slots behind them. The caller holds as_vm_lock.
+ *
+ */
+void
+vm_unmap(struct addrspace *as, vaddr_t start, unsigned npages)
+{
+    unsigned i, n;
+    vaddr_t vaddrs[TLBSHOOTDOWN_MAX];
+    pagetable_t ptes[TLBSHOOTDOWN_MAX];
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    // unmap in batches that go out in one shootdown each, and only
+    // free the frames once no TLB can reach them
+    while (npages > 0) {
+        n = 0;
+        spinlock_acquire(&as->as_lock);
+        while (npages > 0 && n < TLBSHOOTDOWN_MAX) {
+            ptes[n] = as_peek_pt_entry(as, start);
+            if (ptes[n] != 0) {
+                as_set_pt_entry(as, start, 0);
+                vaddrs[n++] = start;
+            }
+            start += PAGE_SIZE;
+            npages--;
+        }
+        // page tables left empty go back to the allocator
+        for (i=0; i<n; i++) {
+            as_trim_pagetable(as, vaddrs[i]);
+        }
+        spinlock_release(&as->as_lock);
+
+        if (n == 0) {
+            // never touched
+            continue;
+        }
+        tlb_shootdown(as, vaddrs, n);
+
+        for (i=0; i<n; i++) {
+            // drop our reference, the frame may still be shared after fork
+            if (ptes[i] & PT_PRESENT_MASK) {
+                free_user_page(ptes[i] & PAGE_FRAME, as, vaddrs[i]);
+            }
+#if SWAP
+            // in swap, or still cached there
+            if (!(ptes[i] & PT_PRESENT_MASK) || (ptes[i] & PT_SWAPCACHE_MASK)) {
+                remove_swap_entry(as, vaddrs[i]);
+            }
+#endif
+        }
+    }
+}
+
+/*
+ *  vm_msync - write the dirty pages in [START, END) of the shared file
+ *  mappings of AS back to their files, and mark them clean. The caller
+ *  holds as_vm_lock.
+ *
+ */
+int
+vm_msync(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    struct vm_region *r;
+    vaddr_t vaddrs[TLBSHOOTDOWN_MAX];
+    pagetable_t ptes[TLBSHOOTDOWN_MAX];
+    pagetable_t pte;
+    vaddr_t vaddr, top;
+    unsigned i, n, ridx;
+    int result = 0;
+
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
+
+    for (ridx = 0; ridx < vm_regionarray_num(&as->as_regions) && !result; ridx++) {
+        r = vm_regionarray_get(&as->as_regions, ridx);
+        if (r->vr_type != VR_FILE || !(r->vr_flags & MAP_SHARED) ||
+            r->vr_top <= start || r->vr_base >= end) {
+            continue;
+        }
+        vaddr = (r->vr_base > start) ? r->vr_base : start;
+        top = (r->vr_top < end) ? r->vr_top : end;
+
+        while (vaddr < top && !result) {
+            // clean a batch first: from the shootdown on, a store
+            // faults and marks the page dirty again
+            n = 0;
+            spinlock_acquire(&as->as_lock);
+            for (; vaddr < top && n < TLBSHOOTDOWN_MAX; vaddr += PAGE_SIZE) {
+                pte = as_peek_pt_entry(as, vaddr);
+                if ((pte & PT_PRESENT_MASK) && (pte & PT_DIRTY_MASK)) {
+                    as_set_pt_entry(as, vaddr, pte & ~PT_DIRTY_MASK);
+                    vaddrs[n] = vaddr;
+                    ptes[n] = pte;
+                    n++;
+                }
+            }
+            spinlock_release(&as->as_lock);
+
+            if (n == 0) {
+                continue;
+            }
+            tlb_shootdown(as, vaddrs, n);
+
+            for (i=0; i<n && !result; i++) {
+                result = as_store_page(as, vaddrs[i], ptes[i] & PAGE_FRAME);
+            }
+            if (result) {
+                // whatever did not make it to the file is still dirty
+                spinlock_acquire(&as->as_lock);
+                for (i--; i<n; i++) {
+                    pte = as_peek_pt_entry(as, vaddrs[i]);
+                    as_set_pt_entry(as, vaddrs[i], pte | PT_DIRTY_MASK);
+                }
+                spinlock_release(&as->as_lock);
+            }
+        }
+    }
+
+    return result;
+}
+
+/*
+ *  frame_unbusy - let go of frame I after a pageout or merge attempt
+ *
+ */
+static
+void
+frame_unbusy(unsigned i)
+{
+    spinlock_acquire(&coremap_lock);
+    _coremap[i].cm_busy = 0;
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ *  ksm_checksum - checksum of the page at KVADDR, *ZERO tells whether
+ *  it is all zero
+ *
+ */
+static
+uint32_t
+ksm_checksum(vaddr_t kvaddr, bool *zero)
+{
+    const uint32_t *p = (const uint32_t *) kvaddr;
+    uint32_t sum = 2166136261U, any = 0;
+    unsigned i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        sum = (sum ^ p[i]) * 16777619U;
+        any |= p[i];
+    }
+    *zero = (any == 0);
+    return sum;
+}
+
+static
+bool
+ksm_same(vaddr_t a, vaddr_t b)
+{
+    const uint32_t *pa = (const uint32_t *) a;
+    const uint32_t *pb = (const uint32_t *) b;
+    unsigned i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (pa[i] != pb[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *  ksm_link - enter frame IDX into ksm_table as a merged frame.
+ *  Called with coremap_lock held.
+ *
+ */
+static
+void
+ksm_link(unsigned idx)
+{
+    unsigned b = ksm_sum[idx] & (KSM_HASH_SIZE - 1);
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    _coremap[idx].cm_entry |= PP_KSM;
+    ksm_next[idx] = ksm_table[b];
+    ksm_table[b] = idx;
+    ksm_nframes++;
+}
+
+/*
+ *  ksm_unlink - take frame IDX out of ksm_table. Called with
+ *  coremap_lock held.
+ *
+ */
+static
+void
+ksm_unlink(unsigned idx)
+{
+    unsigned *prev;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    for (prev = &ksm_table[ksm_sum[idx] & (KSM_HASH_SIZE - 1)]; *prev != idx;
+         prev = &ksm_next[*prev]) {
+        KASSERT(*prev != NO_FRAME);
+    }
+    *prev = ksm_next[idx];
+    _coremap[idx].cm_entry &= ~PP_KSM;
+    ksm_nframes--;
+}
+
+/*
+ *  ksm_candidate - tell whether frame IDX is a private user frame KSM
+ *  may take. Called with coremap_lock held.
+ *
+ */
+static
+bool
+ksm_candidate(unsigned idx)
+{
+    struct coremap_entry *cme = &_coremap[idx];
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    return IS_PPAGE_IN_RAM(cme->cm_entry) && cme->cm_as != NULL &&
+           !cme->cm_busy && cme->cm_refcount == 1 &&
+           !(cme->cm_entry & (PP_TEXT | PP_SHM | PP_KSM));
+}
+
+/*
+ *  ksm_protect - make private frame IDX read-only in the page table of
+ *  its owner, which is handed back in *AS, *VADDR and *PTE, with the
+ *  frame busy and the owner's as_vm_lock held, so that neither the
+ *  mapping nor the contents can change. Returns EAGAIN if the frame is
+ *  no candidate any more or its owner is busy.
+ *
+ */
+static
+int
+ksm_protect(unsigned idx, struct addrspace **as, vaddr_t *vaddr, pagetable_t *pte)
+{
+    paddr_t paddr = user_base_addr + (idx * PAGE_SIZE);
+    struct vm_region *r;
+
+    spinlock_acquire(&coremap_lock);
+    if (!ksm_candidate(idx)) {
+        spinlock_release(&coremap_lock);
+        return EAGAIN;
+    }
+    // the frame is busy, so its owner can't be destroyed under us
+    _coremap[idx].cm_busy = 1;
+    *as = _coremap[idx].cm_as;
+    *vaddr = _coremap[idx].cm_entry & PAGE_FRAME;
+    spinlock_release(&coremap_lock);
+
+    // never sleep on it, the owner may be waiting for the frame
+    if (!lock_tryacquire((*as)->as_vm_lock)) {
+        frame_unbusy(idx);
+        return EAGAIN;
+    }
+
+    // stores to shared memory and shared file mappings must stay
+    // visible to everybody else mapping the same file
+    r = as_find_region(*as, *vaddr);
+    if (r == NULL || r->vr_type == VR_SHM ||
+        (r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED))) {
+        goto fail;
+    }
+
+    spinlock_acquire(&(*as)->as_lock);
+    *pte = as_peek_pt_entry(*as, *vaddr);
+    if (!(*pte & PT_PRESENT_MASK) || (*pte & PAGE_FRAME) != paddr ||
+        (*pte & (PT_COW_MASK | PT_SWAPCACHE_MASK | PT_SHARED_MASK))) {
+        spinlock_release(&(*as)->as_lock);
+        goto fail;
+    }
+    as_set_pt_entry(*as, *vaddr, *pte | PT_COW_MASK);
+    spinlock_release(&(*as)->as_lock);
+
+    // no store can go through a stale TLB entry from here on
+    vm_tlbshootdown_page(*as, *vaddr);
+    return 0;
+
+fail:
+    lock_release((*as)->as_vm_lock);
+    frame_unbusy(idx);
+    return EAGAIN;
+}
+
+/*
+ *  ksm_unprotect - give frame IDX back to its owner as ksm_protect
+ *  found it
+ *
+ */
+static
+void
+ksm_unprotect(unsigned idx, struct addrspace *as, vaddr_t vaddr, pagetable_t pte)
+{
+    spinlock_acquire(&as->as_lock);
+    as_set_pt_entry(as, vaddr, pte);
+    spinlock_release(&as->as_lock);
+    lock_release(as->as_vm_lock);
+    frame_unbusy(idx);
+}
+
+/*
+ *  ksm_stabilize - turn candidate frame IDX into a merged frame, if its
+ *  contents still have the checksum of the last visit. Others can then
+ *  be merged into it.
+ *
+ */
+static
+int
+ksm_stabilize(unsigned idx)
+{
+    struct addrspace *as;
+    vaddr_t vaddr;
+    pagetable_t pte;
+    bool zero;
+    int result;
+
+    result = ksm_protect(idx, &as, &vaddr, &pte);
+    if (result) {
+        return result;
+    }
+    if (ksm_checksum(PADDR_TO_KVADDR(user_base_addr + (idx * PAGE_SIZE)), &zero) !=
+        ksm_sum[idx]) {
+        ksm_unprotect(idx, as, vaddr, pte);
+        return EAGAIN;
+    }
+
+    // it stays copy-on-write
+    spinlock_acquire(&coremap_lock);
+    ksm_link(idx);
+    _coremap[idx].cm_busy = 0;
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+    lock_release(as->as_vm_lock);
+    return 0;
+}
+
+/*
+ *  ksm_merge - map the merged frame TARGET, or the zero frame if
+ *  TARGET is NO_FRAME, in place of private frame IDX, which must have
+ *  the same contents, and free IDX.
+ *
+ */
+static
+int
+ksm_merge(unsigned idx, unsigned target)
+{
+    paddr_t paddr = user_base_addr + (idx * PAGE_SIZE);
+    paddr_t tpaddr;
+    struct rmap_entry *pool;
+    struct addrspace *as;
+    vaddr_t vaddr;
+    pagetable_t pte;
+    int result;
+
+    tpaddr = (target == NO_FRAME) ? zero_frame : user_base_addr + (target * PAGE_SIZE);
+
+    // the merged frame gets another owner
+    result = rmap_reserve(&pool, 1);
+    if (result) {
+        return result;
+    }
+    result = ksm_protect(idx, &as, &vaddr, &pte);
+    if (result) {
+        rmap_release(pool);
+        return result;
+    }
+
+    // the frames are read-only everywhere now; a merged frame that was
+    // written to meanwhile has left ksm_table, which we check below
+    if (!ksm_same(PADDR_TO_KVADDR(paddr), PADDR_TO_KVADDR(tpaddr))) {
+        ksm_unprotect(idx, as, vaddr, pte);
+        rmap_release(pool);
+        return EAGAIN;
+    }
+
+    spinlock_acquire(&as->as_lock);
+    spinlock_acquire(&coremap_lock);
+    if (target != NO_FRAME &&
+        (!IS_PPAGE_KSM(_coremap[target].cm_entry) || _coremap[target].cm_busy)) {
+        spinlock_release(&coremap_lock);
+        spinlock_release(&as->as_lock);
+        ksm_unprotect(idx, as, vaddr, pte);
+        rmap_release(pool);
+        return EAGAIN;
+    }
+
+    // the zero frame is not reference counted, and mapped like a page
+    // that was never written
+    if (target != NO_FRAME) {
+        _coremap[target].cm_refcount++;
+        rmap_add(target, as, vaddr, &pool);
+        as_set_pt_entry(as, vaddr, tpaddr | (pte & ~PAGE_FRAME) | PT_COW_MASK);
+        ksm_merges++;
+    }
+    else {
+        as_set_pt_entry(as, vaddr, zero_frame | PT_VALID_MASK | PT_PRESENT_MASK | PT_COW_MASK);
+        ksm_zero_merges++;
+    }
+
+    _coremap[idx].cm_busy = 0;
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+    free_user_page(paddr, as, vaddr);
+    spinlock_release(&coremap_lock);
+    spinlock_release(&as->as_lock);
+
+    // nobody maps IDX any more, other CPUs may still have it cached
+    vm_tlbshootdown_page(as, vaddr);
+    lock_release(as->as_vm_lock);
+    rmap_release(pool);
+    return 0;
+}
+
+/*
+ *  ksm_scan - visit the next frame under ksm_hand
+ *
+ */
+static
+void
+ksm_scan(void)
+{
+    unsigned idx, target, b;
+    uint32_t sum;
+    bool zero;
+
+    spinlock_acquire(&coremap_lock);
+    idx = ksm_hand;
+    ksm_hand++;
+    if (ksm_hand >= last_page) {
+        // a new pass, the candidates of the last one have moved on
+        ksm_hand = 0;
+        ksm_passes++;
+        for (b = 0; b < KSM_HASH_SIZE; b++) {
+            ksm_unstable[b] = NO_FRAME;
+        }
+    }
+    if (!ksm_candidate(idx)) {
+        spinlock_release(&coremap_lock);
+        return;
+    }
+    spinlock_release(&coremap_lock);
+
+    // the frame may change or go away while we read it, ksm_merge
+    // compares the contents again once it is protected
+    sum = ksm_checksum(PADDR_TO_KVADDR(user_base_addr + (idx * PAGE_SIZE)), &zero);
+    if (sum != ksm_sum[idx]) {
+        // still being written to, or new
+        ksm_sum[idx] = sum;
+        return;
+    }
+
+    if (zero) {
+        ksm_merge(idx, NO_FRAME);
+        return;
+    }
+
+    b = sum & (KSM_HASH_SIZE - 1);
+    spinlock_acquire(&coremap_lock);
+    for (target = ksm_table[b]; target != NO_FRAME; target = ksm_next[target]) {
+        if (ksm_sum[target] == sum && !_coremap[target].cm_busy) {
+            break;
+        }
+    }
+    if (target == NO_FRAME) {
+        target = ksm_unstable[b];
+        if (target == idx || target == NO_FRAME || ksm_sum[target] != sum ||
+            !ksm_candidate(target)) {
+            // the first one like it this pass
+            ksm_unstable[b] = idx;
+            spinlock_release(&coremap_lock);
+            return;
+        }
+        ksm_unstable[b] = NO_FRAME;
+        spinlock_release(&coremap_lock);
+
+        if (ksm_stabilize(target)) {
+            return;
+        }
+    }
+    else {
+        spinlock_release(&coremap_lock);
+    }
+
+    ksm_merge(idx, target);
+}
+
+/*
+ *  ksm_thread - visit ksm_npages frames a second while KSM is on
+ *
+ */
+static
+void
+ksm_thread(void *unused1, unsigned long unused2)
+{
+    unsigned n, npages;
+
+    (void)unused1;
+    (void)unused2;
+
+    while (1) {
+        spinlock_acquire(&coremap_lock);
+        npages = ksm_npages;
+        if (npages == 0) {
+            ksm_running = false;
+            spinlock_release(&coremap_lock);
+            return;
+        }
+        spinlock_release(&coremap_lock);
+
+        for (n = 0; n < npages; n++) {
+            ksm_scan();
+        }
+        clocksleep(1);
+    }
+}
+
+/*
+ *  vm_set_ksm - have the ksm thread look at NPAGES frames a second,
+ *  0 turns same-page merging off. Pages merged so far stay merged.
+ *
+ */
+int
+vm_set_ksm(unsigned npages)
+{
+    unsigned i;
+    bool start;
+    int result;
+
+    if (npages > last_page) {
+        return EINVAL;
+    }
+
+    if (ksm_sum == NULL && npages > 0) {
+        ksm_sum = kmalloc(last_page * sizeof(uint32_t));
+        ksm_next = kmalloc(last_page * sizeof(unsigned));
+        if (ksm_sum == NULL || ksm_next == NULL) {
+            kfree(ksm_sum);
+            kfree(ksm_next);
+            ksm_sum = NULL;
+            ksm_next = NULL;
+            return ENOMEM;
+        }
+        for (i = 0; i < last_page; i++) {
+            ksm_sum[i] = 0;
+            ksm_next[i] = NO_FRAME;
+        }
+        for (i = 0; i < KSM_HASH_SIZE; i++) {
+            ksm_table[i] = NO_FRAME;
+            ksm_unstable[i] = NO_FRAME;
+        }
+    }
+
+    spinlock_acquire(&coremap_lock);
+    ksm_npages = npages;
+    start = (npages > 0 && !ksm_running);
+    if (start) {
+        ksm_running = true;
+    }
+    spinlock_release(&coremap_lock);
+
+    if (start) {
+        result = thread_fork("ksm", NULL, ksm_thread, NULL, 0);
+        if (result) {
+            spinlock_acquire(&coremap_lock);
+            ksm_running = false;
+            ksm_npages = 0;
+            spinlock_release(&coremap_lock);
+            return result;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  vm_getusage - add the fault, swap and resident page counters of AS
+ *  to RU. The resident size is that of AS alone. Counters may move on
+ *  while they are read.
+ *
+ */
+void
+vm_getusage(struct addrspace *as, struct rusage *ru)
+{
+    size_t maxrss = as->as_maxrss * (PAGE_SIZE / 1024);
+
+    ru->ru_minflt += as->as_minflt;
+    ru->ru_majflt += as->as_majflt;
+    ru->ru_ntlbrefill += as->as_tlbrefills;
+    ru->ru_nswapin += as->as_swapins;
+    ru->ru_nswapout += as->as_swapouts;
+    if (maxrss > ru->ru_maxrss) {
+        ru->ru_maxrss = maxrss;
+    }
+    ru->ru_rss = as->as_rss * (PAGE_SIZE / 1024);
+}
+
+/*
+ *  vm_printstats - print frame allocator, fault and coremap_lock counters
+ *
+ */
+void
+vm_printstats(void)
+{
+    struct cpu *c;
+    unsigned i;
+
+    kprintf("frames: %u total, %u free (%u in cpu caches), %u committed to heaps\n",
+            last_page, free_frames(), free_frames() - nbuddypages, ncommitted);
+    kprintf("coremap_lock: %u acquires, %u contended\n",
+            coremap_lock.splk_acquires, coremap_lock.splk_contended);
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        kprintf("cpu%u: %u cached, %u zeroed, %u hits, %u refills, %u drains\n",
+                c->c_number, c->c_nframes, c->c_nzframes, c->c_frame_hits,
+                c->c_frame_refills, c->c_frame_drains);
+        kprintf("cpu%u: %u faults, %u entries loaded around them\n",
+                c->c_number, c->c_vm_faults, c->c_vm_faultaround);
+    }
+    kprintf("fault-around: %u pages\n", vm_faultaround);
+    kprintf("text cache: %u pages, %u hits, %u misses\n",
+            ntextpages, text_hits, text_misses);
+    kprintf("ksm: %u frames a second, %u merged frames, %u pages merged, %u into the zero frame, %u passes\n",
+            ksm_npages, ksm_nframes, ksm_merges, ksm_zero_merges, ksm_passes);
+#if SWAP
+    for (i = 0; i < nswapdevs; i++) {
+        struct swapdev *sd = &swapdevs[i];
+        unsigned j, used = 0;
+
+        spinlock_acquire(&swapmap_lock);
+        for (j = sd->sd_base; j < sd->sd_base + sd->sd_nslots; j++) {
+            if (bitmap_isset(_swapfree, j)) {
+                used++;
+            }
+        }
+        spinlock_release(&swapmap_lock);
+        kprintf("swap %s: %u of %u pages in use\n", sd->sd_name, used, sd->sd_nslots);
+    }
+    kprintf("swap: %u pages written, %u clean pages dropped from the swap cache\n",
+            swap_writes, swap_cache_drops);
+    zswap_printstats();
+#endif
+}
+
+#if SWAP
+/*
+ *  swap_attach - claim the raw disks named in SWAP_DEVICES that exist
+ *  and have no filesystem mounted, and lay their pages out one after
+ *  the other as swap slots
+ *
+ */
+static
+void
+swap_attach(void)
+{
+    struct swapdev *sd;
+    struct vnode *v;
+    struct stat st;
+    char path[32], *name, *ctx, *colon;
+    int result;
+
+    for (name = strtok_r(swap_devices, " ", &ctx);
+         name != NULL && nswapdevs < SWAP_MAX_DEVICES;
+         name = strtok_r(NULL, " ", &ctx)) {
+        // "lhd1raw:" is the raw device lhd1raw
+        snprintf(path, sizeof(path), "%s", name);
+        colon = strchr(path, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+        }
+        result = vfs_swapon(path, &v);
+        if (result) {
+            kprintf("swap: %s: %s\n", name, strerror(result));
+            continue;
+        }
+        // a raw disk reports d_blocks * d_blocksize as its size
+        if (VOP_STAT(v, &st) || st.st_size < PAGE_SIZE) {
+            vfs_close(v);
+            continue;
+        }
+        sd = &swapdevs[nswapdevs++];
+        sd->sd_vnode = v;
+        sd->sd_name = name;
+        sd->sd_base = swap_nslots;
+        sd->sd_nslots = st.st_size / PAGE_SIZE;
+        sd->sd_next = sd->sd_base;
+        swap_nslots += sd->sd_nslots;
+        kprintf("swap: %s, %u pages\n", sd->sd_name, sd->sd_nslots);
+    }
+    if (nswapdevs == 0) {
+        panic("vm_bootstrap: no swap device\n");
+    }
+}
+
+/*
+ *  swap_dev - the device slot IDX is on
+ *
+ */
+static
+struct swapdev *
+swap_dev(unsigned idx)
+{
+    unsigned i;
+
+    for (i = 0; i < nswapdevs; i++) {
+        if (idx < swapdevs[i].sd_base + swapdevs[i].sd_nslots) {
+            return &swapdevs[i];
+        }
+    }
+    panic("swap_dev: no slot %u\n", idx);
+    return NULL;
+}
+
+/*
+ *  swap_hash - bucket of the swap hash table for page ADDR of AS
+ *
+ */
+static
+unsigned
+swap_hash(struct addrspace *as, vaddr_t addr)
+{
+    return (((vaddr_t) as >> 4) ^ (addr >> PAGE_OFFSET_BITS)) & (swap_hashsize - 1);
+}
+
+/*
+ *  swap_insert - chain claimed slot IDX into the hash table for page
+ *  ADDR of AS. Called with swapmap_lock held.
+ *
+ */
+static
+void
+swap_insert(unsigned idx, struct addrspace *as, vaddr_t addr)
+{
+    unsigned bucket = swap_hash(as, addr);
+
+    KASSERT(spinlock_do_i_hold(&swapmap_lock));
+    _swapmap[idx].in_use = true;
+    _swapmap[idx].as = as;
+    _swapmap[idx].addr = addr & PAGE_FRAME;
+    _swapmap[idx].next = _swaphash[bucket];
+    _swaphash[bucket] = idx;
+}
+
+/*
+ *  swap_find_run - find the first run of free slots in FROM up to TO
+ *  that is at least MIN long, taking no more than N of it. Whole bytes
+ *  of slots in use are skipped, as bitmap_alloc does. Returns its
+ *  length, 0 if there is none, and the first slot in START. Called
+ *  with swapmap_lock held.
+ *
+ */
+static
+unsigned
+swap_find_run(unsigned from, unsigned to, unsigned n, unsigned min, unsigned *start)
+{
+    const unsigned char *map = bitmap_getdata(_swapfree);
+    unsigned i, run = 0;
+
+    KASSERT(spinlock_do_i_hold(&swapmap_lock));
+    KASSERT(min >= 1 && min <= n);
+
+    for (i = from; i < to; i++) {
+        if (run == 0 && (i % 8) == 0 && i + 8 <= to && map[i / 8] == 0xff) {
+            i += 7;
+            continue;
+        }
+        if (!bitmap_isset(_swapfree, i)) {
+            if (++run == n) {
+                i++;
+                break;
+            }
+            continue;
+        }
+        if (run >= min) {
+            break;
+        }
+        run = 0;
+    }
+    if (run < min) {
+        return 0;
+    }
+    *start = i - run;
+    return run;
+}
+
+/*
+ *  swap_claim_run - claim up to N free slots in a row on one device.
+ *  The devices take turns, so consecutive clusters are spread over all
+ *  of them, and each is searched next-fit from where its last run
+ *  ended; a device that has no run of N left there gives way to one
+ *  that has. Only when none has, the first free slots of a device are
+ *  taken, however few. Returns the number claimed, and the first slot
+ *  in START. Called with swapmap_lock held.
+ *
+ */
+static
+unsigned
+swap_claim_run(unsigned n, unsigned *start)
+{
+    struct swapdev *sd = NULL;
+    unsigned d, i, end, got = 0;
+
+    KASSERT(spinlock_do_i_hold(&swapmap_lock));
+
+    for (d = 0; d < nswapdevs && got == 0; d++) {
+        sd = &swapdevs[(swap_nextdev + d) % nswapdevs];
+        got = swap_find_run(sd->sd_next, sd->sd_base + sd->sd_nslots, n, n, start);
+    }
+    // the cursors wrap
+    for (d = 0; d < nswapdevs && got == 0; d++) {
+        sd = &swapdevs[(swap_nextdev + d) % nswapdevs];
+        got = swap_find_run(sd->sd_base, sd->sd_base + sd->sd_nslots, n, 1, start);
+    }
+    if (got == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < got; i++) {
+        bitmap_mark(_swapfree, *start + i);
+    }
+    end = sd->sd_base + sd->sd_nslots;
+    sd->sd_next = (*start + got < end) ? *start + got : sd->sd_base;
+    swap_nextdev = (sd - swapdevs + 1) % nswapdevs;
+    return got;
+}
+
+/*
+ *  get_free_swap_idx - claim a swap slot for page ADDR of AS and chain
+ *  it into the hash table
+ *
+ */
+static
+unsigned
+get_free_swap_idx(struct addrspace *as, vaddr_t addr)
+{
+    unsigned idx;
+
+    spinlock_acquire(&swapmap_lock);
+    if (swap_claim_run(1, &idx) == 0) {
+        // We ran out of swap space
+        spinlock_release(&swapmap_lock);
+        kprintf("No more swap space\n");
+        return NO_SWAP_IDX;
+    }
+    swap_insert(idx, as, addr);
+    spinlock_release(&swapmap_lock);
+
+    return idx;
+}
+
+/*
+ *  get_free_swap_run - claim up to N contiguous swap slots, so that a
+ *  cluster can go out in one write. Returns the number claimed, which
+ *  is less than N if no long enough run is free, and the first slot in
+ *  START. The slots still have to be given owners with swap_insert.
+ *
+ */
+static
+unsigned
+get_free_swap_run(unsigned n, unsigned *start)
+{
+    unsigned best;
+
+    spinlock_acquire(&swapmap_lock);
+    best = swap_claim_run(n, start);
+    spinlock_release(&swapmap_lock);
+
+    if (best == 0) {
+        kprintf("No more swap space\n");
     }
+    return best;
+}
 
-    spinlock_acquire(&tlb_lock);
-    
-    int spl = splhigh();
-    uint32_t idx;
-    uint32_t ehi, elo;
-    for (idx = 0; idx < NUM_TLB; idx++) {
-        tlb_read(&ehi, &elo, idx);
-        
-        if ((entryhi & TLBHI_VPAGE) == (ehi & TLBHI_VPAGE)) {
-            tlb_write(entryhi, entrylo, idx);
+static
+unsigned
+find_swap_idx(struct addrspace *as, vaddr_t addr)
+{
+    unsigned idx;
+
+    addr &= PAGE_FRAME;
+    spinlock_acquire(&swapmap_lock);
+    idx = _swaphash[swap_hash(as, addr)];
+    while (idx != NO_SWAP_IDX) {
+        if (_swapmap[idx].as == as && _swapmap[idx].addr == addr) {
             break;
         }
+        idx = _swapmap[idx].next;
     }
-    
-    if (idx == NUM_TLB) {
-        // entry not in TLB, write to a randon location
-        tlb_random(entryhi, entrylo);
-    }
-
-    splx(spl);
+    spinlock_release(&swapmap_lock);
 
+    return idx;
+}
 
-    spinlock_release(&tlb_lock);
-    lock_release(global_lock);
-    return 0;
+/*
+ *  remove_swap_entry - release the swap slot of page ADDR of AS, if any
+ *
+ */
+void
+remove_swap_entry(struct addrspace *as, vaddr_t addr)
+{
+    unsigned *link;
+    unsigned idx;
+
+    addr &= PAGE_FRAME;
+    spinlock_acquire(&swapmap_lock);
+    link = &_swaphash[swap_hash(as, addr)];
+    while (*link != NO_SWAP_IDX) {
+        idx = *link;
+        if (_swapmap[idx].as == as && _swapmap[idx].addr == addr) {
+            *link = _swapmap[idx].next;
+            _swapmap[idx].in_use = false;
+            _swapmap[idx].as = NULL;
+            _swapmap[idx].next = NO_SWAP_IDX;
+            // before anybody can claim the slot again
+            zswap_invalidate(idx);
+            bitmap_unmark(_swapfree, idx);
+            break;
+        }
+        link = &_swapmap[idx].next;
+    }
+    spinlock_release(&swapmap_lock);
 }
 
-int 
-alloc_sbrk_pages(unsigned npages)
+/*
+ *  swap_io - move N pages between the kernel addresses in KVADDRS and
+ *  consecutive swap slots starting at IDX, in a single request to the
+ *  raw disk they are on
+ *
+ */
+static
+int
+swap_io(const vaddr_t *kvaddrs, unsigned n, unsigned idx, enum uio_rw rw)
 {
-    struct addrspace *as = proc_getas();
-    vaddr_t vaddr;
+    struct iovec iov[SWAP_CLUSTER];
+    struct swapdev *sd = swap_dev(idx);
+    struct uio ku;
     unsigned i;
-    pagetable_t pte;
-    uint32_t ppe;
-    paddr_t cmidx;
-    pid_t pid = curproc->pid << 6;
-    bool acquired = spinlock_do_i_hold(&coremap_lock);
 
-    if (!acquired) {    
-        spinlock_acquire(&coremap_lock);
+    KASSERT(n > 0 && n <= SWAP_CLUSTER);
+    KASSERT(idx + n <= sd->sd_base + sd->sd_nslots);
+    for (i = 0; i < n; i++) {
+        iov[i].iov_kbase = (void *) kvaddrs[i];
+        iov[i].iov_len = PAGE_SIZE;
     }
-    
-    bool as_acquired = spinlock_do_i_hold(&as->as_lock);
-    
-    if (!as_acquired) {
-        spinlock_acquire(&as->as_lock);
+    ku.uio_iov = iov;
+    ku.uio_iovcnt = n;
+    ku.uio_offset = (off_t) (idx - sd->sd_base) * PAGE_SIZE;
+    ku.uio_resid = n * PAGE_SIZE;
+    ku.uio_segflg = UIO_SYSSPACE;
+    ku.uio_rw = rw;
+    ku.uio_space = NULL;
+
+    if (rw == UIO_READ) {
+        return VOP_READ(sd->sd_vnode, &ku);
     }
-    
-    vaddr_t heap_top = as->as_heap_top;
-
-    if (nfreepages > npages) {
-        for (i=0; i<npages; i++) {
-            //vaddr = acquire_pages(1);
-            vaddr = acquire_one_page();
-            pte = ((vaddr & PAGE_FRAME) | PT_PRESENT_MASK | PT_DIRTY_MASK);
-            cmidx = ((vaddr & PAGE_FRAME) - user_base_addr) / PAGE_SIZE;
-
-            // set the coremap entry
-            ppe = ((heap_top & PAGE_FRAME) | PP_ALLOC_END | PP_DIRTY | PP_USE | pid);
-            _coremap[cmidx] = ppe;
-    
-            // set the pagetable entry, create pagetable when needed
-            as_set_pt_entry(as, heap_top, pte);
-            
-//            kprintf("vaddr %x, paddr %x\n", heap_top, vaddr); 
-            
-            heap_top += PAGE_SIZE;
-        }
+    return VOP_WRITE(sd->sd_vnode, &ku);
+}
+
+/*
+ *  swap_duplicate - give page ADDR of TO its own copy of the swap slot
+ *  FROM has for it, in the compressed pool if it fits there. Used by
+ *  fork; the caller holds FROM's as_vm_lock.
+ *
+ */
+int
+swap_duplicate(struct addrspace *from, struct addrspace *to, vaddr_t addr)
+{
+    unsigned from_idx, to_idx;
+    vaddr_t kvaddr;
+    void *page;
+    int result;
+
+    from_idx = find_swap_idx(from, addr);
+    KASSERT(from_idx != NO_SWAP_IDX);
+
+    page = kmalloc(PAGE_SIZE);
+    if (page == NULL) {
+        return ENOMEM;
     }
 
-    as->as_heap_top = heap_top;
-   
-    if (!as_acquired) {
-        spinlock_release(&as->as_lock);
+    to_idx = get_free_swap_idx(to, addr);
+    if (to_idx == NO_SWAP_IDX) {
+        kfree(page);
+        return ENOSPC;
     }
-    
-    if (!acquired) {
-        spinlock_release(&coremap_lock);
+
+    kvaddr = (vaddr_t) page;
+    result = 0;
+    if (zswap_load(from_idx, page)) {
+        result = swap_io(&kvaddr, 1, from_idx, UIO_READ);
     }
-        
-    vm_tlbinvalidate();
-    return 0;
+    if (!result && zswap_store(to_idx, page)) {
+        result = swap_io(&kvaddr, 1, to_idx, UIO_WRITE);
+        if (!result) {
+            swap_writes++;
+        }
+    }
+    if (result) {
+        remove_swap_entry(to, addr);
+    }
+
+    kfree(page);
+    return result;
 }
 
-int 
-free_sbrk_pages(unsigned npages)
+/*
+ *  pageout_prepare - get frame I, which the caller has marked busy on
+ *  behalf of AS, ready to be paged out. A page referenced since the
+ *  clock hand last passed gets a second chance instead: its PT_USED
+ *  bit is cleared and its translation dropped from every CPU's TLB,
+ *  so the next touch faults and sets the bit again.
+ *
+ *  On success the owner's as_vm_lock is held, so the page can't be
+ *  faulted back in before it is on disk. *LOCKED tells whether we
+ *  already held it. Returns EAGAIN if the frame should be skipped,
+ *  which includes it no longer having NOWNERS owners.
+ *
+ */
+static
+int
+pageout_prepare(unsigned i, struct addrspace *as, vaddr_t vaddr,
+                unsigned nowners, bool *locked)
 {
-    unsigned i;
-    struct addrspace *as = proc_getas();
-    vaddr_t heap_top;
+    paddr_t paddr = user_base_addr + (i * PAGE_SIZE);
     pagetable_t pte;
-    uint32_t ppe;
-    paddr_t cmidx;
-    
-    bool acquired = spinlock_do_i_hold(&coremap_lock);
-    if (!acquired) {    
-        spinlock_acquire(&coremap_lock);
-    }
 
-    bool as_acquired = spinlock_do_i_hold(&as->as_lock);
-    if (!as_acquired) {
-        spinlock_acquire(&as->as_lock);
+    // the frame is busy, so AS can't be destroyed under us
+    spinlock_acquire(&as->as_lock);
+    pte = as_peek_pt_entry(as, vaddr);
+    if (!(pte & PT_PRESENT_MASK) || (pte & PAGE_FRAME) != paddr) {
+        spinlock_release(&as->as_lock);
+        return EAGAIN;
     }
-    
-    if (npages > 0) {
-        heap_top = as->as_heap_top - (npages * PAGE_SIZE);
-        as->as_heap_top = heap_top;
-        
-        for (i=0; i<npages; i++) {
-            as_get_pt_entry(as, heap_top, &pte);
-            cmidx = ((pte & PAGE_FRAME) - user_base_addr) / PAGE_SIZE;
+    if (pte & PT_USED_MASK) {
+        as_set_pt_entry(as, vaddr, pte & ~PT_USED_MASK);
+        spinlock_release(&as->as_lock);
 
-            // set the coremap entry
-            ppe = PP_FREE;
-            _coremap[cmidx] = ppe;
-    
-            // set the pagetable entry
-            as_set_pt_entry(as, heap_top, 0);
-            
-            nfreepages++;
-            heap_top += PAGE_SIZE;
-        }
+        // by ASID, and on the CPUs it may still be hot on too
+        vm_tlbshootdown_page(as, vaddr);
+        return EAGAIN;
     }
-    if (!as_acquired) {
-        spinlock_release(&as->as_lock);
+    spinlock_release(&as->as_lock);
+
+    // never sleep on another address space's lock, it may be
+    // waiting for us
+    *locked = lock_do_i_hold(as->as_vm_lock);
+    if (!*locked && !lock_tryacquire(as->as_vm_lock)) {
+        return EAGAIN;
     }
-    
-    if (!acquired) {    
+
+    // recheck now that no fault can be in progress on AS
+    spinlock_acquire(&as->as_lock);
+    pte = as_peek_pt_entry(as, vaddr);
+    spinlock_acquire(&coremap_lock);
+    if (!(pte & PT_PRESENT_MASK) || (pte & PAGE_FRAME) != paddr ||
+        frame_nmaps(i) != nowners) {
         spinlock_release(&coremap_lock);
+        spinlock_release(&as->as_lock);
+        if (!*locked) {
+            lock_release(as->as_vm_lock);
+        }
+        return EAGAIN;
     }
-    
+    spinlock_release(&coremap_lock);
+    spinlock_release(&as->as_lock);
+
     return 0;
 }
 
-#if SWAP
+/*
+ *  pageout_file - reclaim frame I, holding page VADDR of a file mapping
+ *  of AS, without swap. A clean page is dropped and read back from the
+ *  file on the next touch; a dirty page of a shared mapping is written
+ *  to the file first. Called like pageout_prepare's caller, with the
+ *  frame busy and the owner's as_vm_lock held.
+ *
+ */
 static
-unsigned
-get_free_swap_idx(void)
+int
+pageout_file(unsigned i, struct addrspace *as, vaddr_t vaddr, pagetable_t pte)
 {
-    // Incomplete - need a way to map existing physical pages to swap memory, and virtual addresses to swap memory somehow
-    //
-    bool acquired = spinlock_do_i_hold(&swapmap_lock);
-    if (!acquired) {    
-        spinlock_acquire(&swapmap_lock);
-    }
-    for (unsigned i = 0; i < NUM_SW_PAGES; i++) {
-        if (!_swapmap[i].in_use) {
-            if (!acquired) {    
-                spinlock_release(&swapmap_lock);
-            }
-            return i;
+    paddr_t paddr = user_base_addr + (i * PAGE_SIZE);
+    int result = 0;
+
+    spinlock_acquire(&as->as_lock);
+    as_set_pt_entry(as, vaddr, 0);
+    spinlock_release(&as->as_lock);
+    vm_tlbshootdown_page(as, vaddr);
+
+    if (pte & PT_DIRTY_MASK) {
+        result = as_store_page(as, vaddr, paddr);
+        if (result) {
+            // keep it, maybe the file can take it later
+            spinlock_acquire(&as->as_lock);
+            as_set_pt_entry(as, vaddr, pte);
+            spinlock_release(&as->as_lock);
+            return result;
         }
     }
 
-    // We ran out of swap space
-    kprintf("No more swap space\n");
-    if (!acquired) {    
-        spinlock_release(&swapmap_lock);
-    }
-    return NO_SWAP_IDX;
+    // that may have been the last page its table mapped
+    as_trim_pagetable(as, vaddr);
+    return 0;
 }
 
+struct pageout_victim {
+    unsigned pv_frame;
+    struct addrspace *pv_as;
+    vaddr_t pv_vaddr;
+    bool pv_locked;         // as_vm_lock was already ours
+};
+
+/*
+ *  pageout_text - reclaim text cache frame I from its NOWNERS owners
+ *  in PVS, all got ready by pageout_prepare. Text is never dirty, so
+ *  the owners just forget the page and fault it back in from the cache
+ *  or the file; the frame leaves the cache too.
+ *
+ */
 static
-unsigned
-find_swap_idx(paddr_t addr, pid_t pid)
+void
+pageout_text(unsigned i, struct pageout_victim *pvs, unsigned nowners)
 {
-    bool acquired = spinlock_do_i_hold(&swapmap_lock);
-    if (!acquired) {    
-        spinlock_acquire(&swapmap_lock);
+    paddr_t paddr = user_base_addr + (i * PAGE_SIZE);
+    struct pageout_victim *pv;
+    unsigned k;
+
+    for (k = 0; k < nowners; k++) {
+        pv = &pvs[k];
+        spinlock_acquire(&pv->pv_as->as_lock);
+        as_set_pt_entry(pv->pv_as, pv->pv_vaddr, 0);
+        as_trim_pagetable(pv->pv_as, pv->pv_vaddr);
+        spinlock_release(&pv->pv_as->as_lock);
+        vm_tlbshootdown_page(pv->pv_as, pv->pv_vaddr);
     }
-    for (unsigned i = 0; i < NUM_SW_PAGES; i++) {
-        if (_swapmap[i].pid == pid && _swapmap[i].addr == addr && _swapmap[i].in_use) {
-            if (!acquired) {    
-                spinlock_release(&swapmap_lock);
-            }
-            return i;
-        }
+
+    // the owners are still locked, so none of them has gone away
+    spinlock_acquire(&coremap_lock);
+    _coremap[i].cm_busy = 0;
+    for (k = 0; k < nowners; k++) {
+        free_user_page(paddr, pvs[k].pv_as, pvs[k].pv_vaddr);
     }
+    textcache_drop(_coremap[i].cm_text);
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
 
-    //kprintf("Page not found in swap\n");
-    if (!acquired) {    
-        spinlock_release(&swapmap_lock);
+    for (k = 0; k < nowners; k++) {
+        if (!pvs[k].pv_locked) {
+            lock_release(pvs[k].pv_as->as_vm_lock);
+        }
     }
-    return NO_SWAP_IDX;
 }
 
-void
-remove_swap_entry(vaddr_t addr, pid_t pid)
+/*
+ *  pageout_shared - reclaim frame I of a shared file mapping from the
+ *  NOWNERS owners in PVS that fork left mapping it, all got ready by
+ *  pageout_prepare. The page has to stay shared, so rather than giving
+ *  each owner a swap slot, each one goes through pageout_file; an owner
+ *  whose stores the file would not take keeps the page. Returns 0 if
+ *  the frame was freed.
+ *
+ */
+static
+int
+pageout_shared(unsigned i, struct pageout_victim *pvs, unsigned nowners)
 {
-    bool acquired = spinlock_do_i_hold(&swapmap_lock);
-    if (!acquired) {    
-        spinlock_acquire(&swapmap_lock);
+    paddr_t paddr = user_base_addr + (i * PAGE_SIZE);
+    struct pageout_victim *pv;
+    bool dropped[SWAP_CLUSTER];
+    pagetable_t pte;
+    unsigned k;
+    int result = 0;
+
+    // our as_vm_locks keep every owner's dirty bit as it is
+    for (k = 0; k < nowners; k++) {
+        pv = &pvs[k];
+        spinlock_acquire(&pv->pv_as->as_lock);
+        pte = as_peek_pt_entry(pv->pv_as, pv->pv_vaddr);
+        spinlock_release(&pv->pv_as->as_lock);
+
+        dropped[k] = (pageout_file(i, pv->pv_as, pv->pv_vaddr, pte) == 0);
+        if (!dropped[k]) {
+            result = EIO;
+        }
     }
-    for (unsigned i = 0; i < NUM_SW_PAGES; i++) {
-        if (_swapmap[i].pid == pid && _swapmap[i].addr == addr && _swapmap[i].in_use) {
-            _swapmap[i].in_use = false;
-            if (!acquired) {    
-                spinlock_release(&swapmap_lock);
-            }
-            return;
+
+    spinlock_acquire(&coremap_lock);
+    _coremap[i].cm_busy = 0;
+    for (k = 0; k < nowners; k++) {
+        if (dropped[k]) {
+            free_user_page(paddr, pvs[k].pv_as, pvs[k].pv_vaddr);
         }
     }
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
 
-    //kprintf("Page not found in swap\n");
-    if (!acquired) {    
-        spinlock_release(&swapmap_lock);
+    for (k = 0; k < nowners; k++) {
+        if (!pvs[k].pv_locked) {
+            lock_release(pvs[k].pv_as->as_vm_lock);
+        }
     }
-    return;
+    return result;
 }
 
-// Swapout a page to disk according to swapclock
-void
+/*
+ *  swapout - page out a cluster of up to SWAP_CLUSTER user frames,
+ *  chosen by the clock hand swapclock with second-chance on PT_USED,
+ *  to consecutive swap slots. Pages that compress go to the compressed
+ *  pool, the rest is written in as few requests as the gaps allow. A
+ *  frame shared after fork is taken from all of its owners at once,
+ *  found through the reverse map, and each of them gets its own slot,
+ *  unless it belongs to a shared file mapping (see pageout_shared).
+ *  Pages of mapped files that the file can give back, and program text,
+ *  are reclaimed on the spot instead (see pageout_file and
+ *  pageout_text).
+ *
+ */
+int
 swapout(void)
 {
-    int result; 
-    unsigned i = swapclock + 1;
-    if (i >= last_page) {
-        i = 0;
-    }
+    struct pageout_victim victims[SWAP_CLUSTER];
+    vaddr_t kvaddrs[SWAP_CLUSTER];
+    bool zstored[SWAP_CLUSTER];
+    struct pageout_victim *pv;
+    struct rmap_entry *rm;
+    struct vm_region *r;
+    struct addrspace *as;
+    vaddr_t vaddr;
+    pagetable_t pte = 0;
+    unsigned i, k, n, nvictims, ndropped, nslots, slot, nowners;
+    bool locked, reclaimed, text;
+    int result;
+
+    // two sweeps: the first may only clear reference bits
+    nvictims = ndropped = 0;
+    for (n = 0; n < 2 * last_page && nvictims + ndropped < SWAP_CLUSTER; n++) {
+        spinlock_acquire(&coremap_lock);
+        i = swapclock;
+        swapclock++;
+        if (swapclock >= last_page) {
+            swapclock = 0;
+        }
 
-    while (i != swapclock) {
-        bool acquired = spinlock_do_i_hold(&coremap_lock);
-        if (!acquired) {    
-            spinlock_acquire(&coremap_lock);
+        // every owner of the frame needs a victim slot
+        as = _coremap[i].cm_as;
+        nowners = frame_nmaps(i);
+        text = IS_PPAGE_TEXT(_coremap[i].cm_entry);
+        if (text && as == NULL && !_coremap[i].cm_busy) {
+            // cached text nobody runs, unless it was looked up lately
+            if (_coremap[i].cm_entry & PP_TEXT_USED) {
+                _coremap[i].cm_entry &= ~PP_TEXT_USED;
+            }
+            else {
+                textcache_drop(_coremap[i].cm_text);
+                ndropped++;
+            }
+            spinlock_release(&coremap_lock);
+            continue;
+        }
+        // shared memory has no place in swap
+        if (!IS_PPAGE_IN_RAM(_coremap[i].cm_entry) || as == NULL ||
+            IS_PPAGE_SHM(_coremap[i].cm_entry) ||
+            _coremap[i].cm_busy || nowners > SWAP_CLUSTER - nvictims - ndropped) {
+            spinlock_release(&coremap_lock);
+            continue;
+        }
+        _coremap[i].cm_busy = 1;
+        vaddr = _coremap[i].cm_entry & PAGE_FRAME;
+
+        // while the frame is busy its owners may only go away, and
+        // pageout_prepare notices that
+        pv = &victims[nvictims];
+        pv->pv_as = as;
+        pv->pv_vaddr = vaddr;
+        for (k = 1, rm = _coremap[i].cm_rmap; k < nowners && rm != NULL; k++, rm = rm->rm_next) {
+            victims[nvictims + k].pv_as = rm->rm_as;
+            victims[nvictims + k].pv_vaddr = rm->rm_vaddr;
         }
+        KASSERT(k == nowners);
+        spinlock_release(&coremap_lock);
 
-        if (IS_PPAGE_FIXED(_coremap[i])) {
-            if (!acquired) {    
-                spinlock_release(&coremap_lock);
+        if (nowners > 1 || text) {
+            // unmap it everywhere or nowhere
+            for (k = 0; k < nowners; k++) {
+                pv = &victims[nvictims + k];
+                pv->pv_frame = i;
+                if (pageout_prepare(i, pv->pv_as, pv->pv_vaddr, nowners, &pv->pv_locked)) {
+                    break;
+                }
+            }
+            if (k < nowners) {
+                while (k-- > 0) {
+                    pv = &victims[nvictims + k];
+                    if (!pv->pv_locked) {
+                        lock_release(pv->pv_as->as_vm_lock);
+                    }
+                }
+                frame_unbusy(i);
+                continue;
+            }
+            if (text) {
+                pageout_text(i, &victims[nvictims], nowners);
+                ndropped++;
+                continue;
+            }
+            r = as_find_region(victims[nvictims].pv_as, victims[nvictims].pv_vaddr);
+            if (r != NULL && r->vr_type == VR_FILE && (r->vr_flags & MAP_SHARED)) {
+                if (pageout_shared(i, &victims[nvictims], nowners) == 0) {
+                    ndropped++;
+                }
+                continue;
             }
-            goto nextpage;
+            nvictims += nowners;
+            continue;
         }
 
-        if (IS_PPAGE_FREE(_coremap[i])) {
-            if (!acquired) {    
-                spinlock_release(&coremap_lock);
+        if (pageout_prepare(i, as, vaddr, 1, &locked)) {
+            frame_unbusy(i);
+            continue;
+        }
+
+        spinlock_acquire(&as->as_lock);
+        pte = as_peek_pt_entry(as, vaddr);
+        spinlock_release(&as->as_lock);
+
+        r = as_find_region(as, vaddr);
+        if ((pte & PT_SWAPCACHE_MASK) && !(pte & PT_DIRTY_MASK)) {
+            // swap still holds the page as it is, just let go of the frame
+            spinlock_acquire(&as->as_lock);
+            as_set_pt_entry(as, vaddr, PT_VALID_MASK);
+            spinlock_release(&as->as_lock);
+            vm_tlbshootdown_page(as, vaddr);
+            swap_cache_drops++;
+            as->as_swapouts++;
+            result = 0;
+            reclaimed = true;
+        }
+        else if (r != NULL && r->vr_type == VR_FILE &&
+                 (!(pte & PT_DIRTY_MASK) || (r->vr_flags & MAP_SHARED))) {
+            result = pageout_file(i, as, vaddr, pte);
+            reclaimed = true;
+        }
+        else {
+            reclaimed = false;
+        }
+        if (reclaimed) {
+            if (!locked) {
+                lock_release(as->as_vm_lock);
+            }
+            spinlock_acquire(&coremap_lock);
+            _coremap[i].cm_busy = 0;
+            wchan_wakeall(coremap_wchan, &coremap_lock);
+            if (!result) {
+                free_user_page(user_base_addr + (i * PAGE_SIZE), as, vaddr);
+                ndropped++;
             }
-            goto nextpage;
+            spinlock_release(&coremap_lock);
+            continue;
         }
 
-        unsigned swap_idx = get_free_swap_idx();
+        // it has to be written
+        pv = &victims[nvictims++];
+        pv->pv_frame = i;
+        pv->pv_as = as;
+        pv->pv_vaddr = vaddr;
+        pv->pv_locked = locked;
+    }
 
-        paddr_t paddr_from_page = user_base_addr + (i * PAGE_SIZE);
+    // vnodes of the text pages dropped
+    textcache_reap();
 
-        struct iovec iov;
-        struct uio ku;
+    if (nvictims == 0) {
+        return (ndropped > 0) ? 0 : ENOMEM;
+    }
 
-        uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(paddr_from_page), PAGE_SIZE, (off_t) swap_idx * PAGE_SIZE, UIO_WRITE);
+    nslots = get_free_swap_run(nvictims, &slot);
 
-        _coremap[i] = PP_FREE;
-        nfreepages++;
+    // the page tables now point at swap
+    for (i = 0; i < nslots; i++) {
+        pv = &victims[i];
+        spinlock_acquire(&pv->pv_as->as_lock);
+        pte = as_peek_pt_entry(pv->pv_as, pv->pv_vaddr);
+        as_set_pt_entry(pv->pv_as, pv->pv_vaddr, PT_VALID_MASK);
+        spinlock_release(&pv->pv_as->as_lock);
+        pv->pv_as->as_swapouts++;
 
-        bool swaplk_acquired = spinlock_do_i_hold(&swapmap_lock);
-        if (!swaplk_acquired) {    
-            spinlock_acquire(&swapmap_lock);
+        // a slot the page is still cached in gives way to the new one
+        if (pte & PT_SWAPCACHE_MASK) {
+            remove_swap_entry(pv->pv_as, pv->pv_vaddr);
         }
+        spinlock_acquire(&swapmap_lock);
+        swap_insert(slot + i, pv->pv_as, pv->pv_vaddr);
+        spinlock_release(&swapmap_lock);
 
-        _swapmap[swap_idx].in_use = true;
-        _swapmap[swap_idx].addr = user_base_addr + (i * PAGE_SIZE);
-        _swapmap[swap_idx].pid = (_coremap[i] & PP_PID_MASK) >> 6;
+        kvaddrs[i] = PADDR_TO_KVADDR(user_base_addr + (pv->pv_frame * PAGE_SIZE));
+        vm_tlbshootdown_page(pv->pv_as, pv->pv_vaddr);
+    }
 
-        if (!swaplk_acquired) {    
-            spinlock_release(&swapmap_lock);
-        }
-        
-        if (!acquired) {    
-            spinlock_release(&coremap_lock);
+    // nobody can touch the pages any more, keep what compresses in RAM
+    for (i = 0; i < nslots; i++) {
+        zstored[i] = (zswap_store(slot + i, (void *) kvaddrs[i]) == 0);
+    }
+    for (i = 0; i < nslots; i = k) {
+        if (zstored[i]) {
+            k = i + 1;
+            continue;
         }
-        
-        result = VOP_WRITE(swap_vnode, &ku);
+        for (k = i + 1; k < nslots && !zstored[k]; k++);
+        result = swap_io(&kvaddrs[i], k - i, slot + i, UIO_WRITE);
         if (result) {
-            panic("ERROR writing to swap diskn\n");
+            panic("ERROR writing to swap disk\n");
         }
+        swap_writes += k - i;
+    }
 
-        vm_tlbinvalidate();
-        break;
+    // victims past the end of the swap run stay where they are
+    for (i = 0; i < nvictims; i++) {
+        pv = &victims[i];
+        if (!pv->pv_locked) {
+            lock_release(pv->pv_as->as_vm_lock);
+        }
 
-    nextpage:
-        i++;
-        if (i >= last_page) {
-            i = 0; 
+        spinlock_acquire(&coremap_lock);
+        _coremap[pv->pv_frame].cm_busy = 0;
+        wchan_wakeall(coremap_wchan, &coremap_lock);
+        if (i < nslots) {
+            free_user_page(user_base_addr + (pv->pv_frame * PAGE_SIZE),
+                           pv->pv_as, pv->pv_vaddr);
         }
+        spinlock_release(&coremap_lock);
     }
 
-    swapclock++;
+    return (nslots > 0 || ndropped > 0) ? 0 : ENOSPC;
 }
 
-int 
-swapin(vaddr_t addr, pid_t pid)
+/*
+ *  pageout_thread - keep between PAGEOUT_LOW and PAGEOUT_HIGH frames
+ *  free so that faults rarely have to write to swap themselves.
+ *
+ */
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
 {
-    if (nfreepages == 0) {
-        kprintf("No free physical pages - cannot swapin\n");
-        return SWAPIN_NO_MEM;
+    (void) unused1;
+    (void) unused2;
+
+    while (1) {
+        spinlock_acquire(&coremap_lock);
+        while (free_frames() > PAGEOUT_LOW) {
+            wchan_sleep(pageout_wchan, &coremap_lock);
+        }
+        spinlock_release(&coremap_lock);
+
+        while (free_frames() < PAGEOUT_HIGH) {
+            if (swapout()) {
+                // nothing we may evict right now, or swap is full
+                clocksleep(1);
+                break;
+            }
+        }
     }
-    struct iovec iov;
-    struct uio ku;
-    unsigned start = next_free;
+}
+
+/*
+ *  swapin - bring page ADDR of AS back from swap into a new frame
+ *  returned in RET. A page in the compressed pool is expanded from
+ *  there and gives up its slot; one on disk keeps the slot as a swap
+ *  cache, which is what CACHED tells. Pages of AS in the disk slots
+ *  right after it were most likely paged out together with it, so
+ *  while frames are plentiful they are read in by the same request
+ *  and mapped unreferenced. The caller holds as_vm_lock, so the swap
+ *  entries of AS can't change under us.
+ *
+ */
+int
+swapin(struct addrspace *as, vaddr_t addr, paddr_t *ret, bool *cached)
+{
+    vaddr_t vaddrs[SWAP_CLUSTER];
+    vaddr_t kvaddrs[SWAP_CLUSTER];
+    paddr_t paddrs[SWAP_CLUSTER];
+    paddr_t paddr;
+    struct swapdev *sd;
+    pagetable_t pte;
+    unsigned swap_idx, n, i;
+    int result;
 
-    paddr_t paddr = ((KVADDR_TO_PADDR(addr) & PAGE_FRAME) - user_base_addr) / PAGE_SIZE; 
+    KASSERT(lock_do_i_hold(as->as_vm_lock));
 
-    unsigned swap_idx = find_swap_idx(paddr, pid);
+    swap_idx = find_swap_idx(as, addr);
     if (swap_idx == NO_SWAP_IDX) {
-        //kprintf("Address of this process not found in swap\n");
-        // Not in swap
-        return SWAPIN_NOT_FOUND;
+        panic("swapin: page 0x%x missing from swap\n", addr);
     }
 
-    bool acquired = spinlock_do_i_hold(&coremap_lock);
-    if (!acquired) {    
-        spinlock_acquire(&coremap_lock);
+    paddr = acquire_user_page(as, addr);
+    while (paddr == 0) {
+        result = swapout();
+        if (result) {
+            kprintf("No free physical pages - cannot swapin\n");
+            return ENOMEM;
+        }
+        paddr = acquire_user_page(as, addr);
+    }
+    vaddrs[0] = addr & PAGE_FRAME;
+    paddrs[0] = paddr;
+
+    // no I/O at all if it is still in the pool
+    if (zswap_load(swap_idx, (void *) PADDR_TO_KVADDR(paddr)) == 0) {
+        remove_swap_entry(as, addr);
+        as->as_swapins++;
+        *cached = false;
+        *ret = paddr;
+        return 0;
     }
 
-    //find a free page in physical memory
-    for (unsigned i = 0; i < last_page; i++) {
-        if (IS_PPAGE_FREE(_coremap[start])) {
-            _coremap[start] = (PP_ALLOC_END | PP_CLEAN | PP_USE | pid);
-            nfreepages--;
+    // read ahead on the same disk, but don't push anyone else out to
+    // do it
+    sd = swap_dev(swap_idx);
+    for (n = 1; n < SWAP_CLUSTER; n++) {
+        if (swap_idx + n >= sd->sd_base + sd->sd_nslots || free_frames() <= PAGEOUT_LOW) {
             break;
         }
-        start++;
-        if (start >= last_page)
-            start = 0;
-    }
-
+        spinlock_acquire(&swapmap_lock);
+        if (!_swapmap[swap_idx + n].in_use || _swapmap[swap_idx + n].as != as) {
+            spinlock_release(&swapmap_lock);
+            break;
+        }
+        // pages in the pool were never written to the disk
+        if (zswap_holds(swap_idx + n)) {
+            spinlock_release(&swapmap_lock);
+            break;
+        }
+        vaddrs[n] = _swapmap[swap_idx + n].addr;
+        spinlock_release(&swapmap_lock);
 
-    // TODO - figure out how to access correct swap offset and select correct memory
-    uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE, (off_t) swap_idx * PAGE_SIZE, UIO_READ);
+        // a slot may just be caching a page that is in RAM already
+        spinlock_acquire(&as->as_lock);
+        pte = as_peek_pt_entry(as, vaddrs[n]);
+        spinlock_release(&as->as_lock);
+        if (pte != PT_VALID_MASK) {
+            break;
+        }
 
-    next_free = start + 1;
-    if (next_free >= last_page)
-        next_free = 0;
+        paddrs[n] = acquire_user_page(as, vaddrs[n]);
+        if (paddrs[n] == 0) {
+            break;
+        }
+    }
 
-    if (!acquired) {    
+    for (i = 0; i < n; i++) {
+        kvaddrs[i] = PADDR_TO_KVADDR(paddrs[i]);
+    }
+    result = swap_io(kvaddrs, n, swap_idx, UIO_READ);
+    if (result) {
+        spinlock_acquire(&coremap_lock);
+        for (i = 0; i < n; i++) {
+            free_user_page(paddrs[i], as, vaddrs[i]);
+        }
         spinlock_release(&coremap_lock);
+        return result;
     }
-    
-    VOP_READ(swap_vnode, &ku);
 
+    // the slots stay claimed as a swap cache: until a page is written
+    // to, evicting it again needs no write. The faulting page is mapped
+    // by our caller.
+    spinlock_acquire(&as->as_lock);
+    for (i = 1; i < n; i++) {
+        as_set_pt_entry(as, vaddrs[i],
+                        paddrs[i] | PT_VALID_MASK | PT_PRESENT_MASK | PT_SWAPCACHE_MASK);
+    }
+    spinlock_release(&as->as_lock);
+    as->as_swapins += n;
+
+    *cached = true;
+    *ret = paddr;
     return 0;
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,308 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <lz.h>
+#include <zswap.h>
+
+#if SWAP
+
+// pool frames are handed out in chunks, a compressed page takes a run
+// of them within one frame
+#define ZSWAP_CHUNK         64
+#define ZSWAP_NCHUNKS       (PAGE_SIZE / ZSWAP_CHUNK)
+#define ZSWAP_NONE          0xFFFFFFFF
+
+struct zswap_page {
+    vaddr_t zp_kvaddr;                      // 0 while there is no frame here
+    uint32_t zp_map[ZSWAP_NCHUNKS / 32];    // chunks in use
+    unsigned zp_nfree;
+};
+
+// Lock order: swapmap_lock, zswap_lock, coremap_lock. zswap_buflock
+// is a sleep lock, taken before any of them.
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static struct lock *zswap_buflock;
+
+static struct zswap_page *zswap_pages;  // the pool, zswap_maxpages long
+static unsigned zswap_maxpages;
+static unsigned zswap_npages;           // pool frames allocated
+static uint32_t *zswap_handle;          // per slot: first chunk, or ZSWAP_NONE
+static uint16_t *zswap_len;             // per slot: compressed size in bytes
+static void *zswap_buf;                 // compressor scratch, under zswap_buflock
+
+static unsigned zswap_stored;           // pages in the pool
+static unsigned zswap_bytes;            // their compressed size
+static unsigned zswap_stores;           // pages compressed into the pool
+static unsigned zswap_loads;            // pages expanded from the pool
+static unsigned zswap_rejects;          // pages that did not compress
+static unsigned zswap_overflows;        // pages sent to disk with the pool full
+
+/*
+ *  zswap_bootstrap - set up an empty pool for NSLOTS swap slots, that
+ *  will grow to MAXPAGES frames at most
+ *
+ */
+void
+zswap_bootstrap(unsigned nslots, unsigned maxpages)
+{
+    unsigned i;
+
+    zswap_maxpages = maxpages;
+    zswap_pages = kmalloc(maxpages * sizeof(struct zswap_page));
+    zswap_handle = kmalloc(nslots * sizeof(uint32_t));
+    zswap_len = kmalloc(nslots * sizeof(uint16_t));
+    zswap_buf = kmalloc(LZ_WORKSIZE + ZSWAP_MAX_SIZE);
+    zswap_buflock = lock_create("zswap");
+    if (zswap_pages == NULL || zswap_handle == NULL || zswap_len == NULL ||
+        zswap_buf == NULL || zswap_buflock == NULL) {
+        panic("zswap_bootstrap: out of memory\n");
+    }
+    bzero(zswap_pages, maxpages * sizeof(struct zswap_page));
+    for (i = 0; i < nslots; i++) {
+        zswap_handle[i] = ZSWAP_NONE;
+    }
+}
+
+static
+bool
+zswap_chunk_used(struct zswap_page *zp, unsigned c)
+{
+    return (zp->zp_map[c / 32] & (1U << (c % 32))) != 0;
+}
+
+static
+void
+zswap_chunk_set(struct zswap_page *zp, unsigned c, unsigned n, bool used)
+{
+    for (; n > 0; c++, n--) {
+        if (used) {
+            zp->zp_map[c / 32] |= (1U << (c % 32));
+        }
+        else {
+            zp->zp_map[c / 32] &= ~(1U << (c % 32));
+        }
+    }
+}
+
+/*
+ *  zswap_alloc - take the first run of N free chunks in the pool.
+ *  Returns its handle, or ZSWAP_NONE if no frame has one. Called with
+ *  zswap_lock held.
+ *
+ */
+static
+uint32_t
+zswap_alloc(unsigned n)
+{
+    struct zswap_page *zp;
+    unsigned p, c, run;
+
+    KASSERT(spinlock_do_i_hold(&zswap_lock));
+
+    for (p = 0; p < zswap_maxpages; p++) {
+        zp = &zswap_pages[p];
+        if (zp->zp_kvaddr == 0 || zp->zp_nfree < n) {
+            continue;
+        }
+        run = 0;
+        for (c = 0; c < ZSWAP_NCHUNKS; c++) {
+            run = zswap_chunk_used(zp, c) ? 0 : run + 1;
+            if (run == n) {
+                c = c + 1 - n;
+                zswap_chunk_set(zp, c, n, true);
+                zp->zp_nfree -= n;
+                return p * ZSWAP_NCHUNKS + c;
+            }
+        }
+    }
+    return ZSWAP_NONE;
+}
+
+/*
+ *  zswap_grow - give the pool the frame at KVADDR. Returns false if it
+ *  is full already. Called with zswap_lock held.
+ *
+ */
+static
+bool
+zswap_grow(vaddr_t kvaddr)
+{
+    unsigned p;
+
+    KASSERT(spinlock_do_i_hold(&zswap_lock));
+
+    for (p = 0; p < zswap_maxpages; p++) {
+        if (zswap_pages[p].zp_kvaddr == 0) {
+            zswap_pages[p].zp_kvaddr = kvaddr;
+            bzero(zswap_pages[p].zp_map, sizeof(zswap_pages[p].zp_map));
+            zswap_pages[p].zp_nfree = ZSWAP_NCHUNKS;
+            zswap_npages++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static
+void *
+zswap_addr(uint32_t handle)
+{
+    return (void *) (zswap_pages[handle / ZSWAP_NCHUNKS].zp_kvaddr +
+                     (handle % ZSWAP_NCHUNKS) * ZSWAP_CHUNK);
+}
+
+/*
+ *  zswap_store - compress PAGE into the pool as slot SLOT. A page
+ *  bigger than ZSWAP_MAX_SIZE compressed is not worth keeping (E2BIG);
+ *  when no frame of the pool has room and the pool can't grow, the
+ *  page has to go to disk (ENOSPC).
+ *
+ */
+int
+zswap_store(unsigned slot, const void *page)
+{
+    uint8_t *out = (uint8_t *) zswap_buf + LZ_WORKSIZE;
+    vaddr_t kvaddr;
+    uint32_t handle;
+    size_t len;
+    unsigned n;
+
+    lock_acquire(zswap_buflock);
+    len = lz_compress(page, PAGE_SIZE, out, ZSWAP_MAX_SIZE, zswap_buf);
+    if (len == 0) {
+        zswap_rejects++;
+        lock_release(zswap_buflock);
+        return E2BIG;
+    }
+    n = DIVROUNDUP(len, ZSWAP_CHUNK);
+
+    spinlock_acquire(&zswap_lock);
+    KASSERT(zswap_handle[slot] == ZSWAP_NONE);
+    handle = zswap_alloc(n);
+    if (handle == ZSWAP_NONE && zswap_npages < zswap_maxpages) {
+        // the frame allocator takes coremap_lock
+        spinlock_release(&zswap_lock);
+        kvaddr = alloc_kpages(1);
+        spinlock_acquire(&zswap_lock);
+        if (kvaddr != 0 && !zswap_grow(kvaddr)) {
+            spinlock_release(&zswap_lock);
+            free_kpages(kvaddr);
+            spinlock_acquire(&zswap_lock);
+        }
+        handle = zswap_alloc(n);
+    }
+    if (handle == ZSWAP_NONE) {
+        zswap_overflows++;
+        spinlock_release(&zswap_lock);
+        lock_release(zswap_buflock);
+        return ENOSPC;
+    }
+    memcpy(zswap_addr(handle), out, len);
+    zswap_handle[slot] = handle;
+    zswap_len[slot] = len;
+    zswap_stored++;
+    zswap_bytes += len;
+    zswap_stores++;
+    spinlock_release(&zswap_lock);
+
+    lock_release(zswap_buflock);
+    return 0;
+}
+
+/*
+ *  zswap_load - expand slot SLOT from the pool into PAGE. The slot
+ *  stays in the pool until zswap_invalidate.
+ *
+ */
+int
+zswap_load(unsigned slot, void *page)
+{
+    uint32_t handle;
+    size_t len;
+
+    spinlock_acquire(&zswap_lock);
+    handle = zswap_handle[slot];
+    len = zswap_len[slot];
+    if (handle != ZSWAP_NONE) {
+        zswap_loads++;
+    }
+    spinlock_release(&zswap_lock);
+
+    if (handle == ZSWAP_NONE) {
+        return ENOENT;
+    }
+
+    // the chunks are ours until the slot is dropped, and a frame with
+    // chunks in use never leaves the pool
+    if (lz_decompress(zswap_addr(handle), len, page, PAGE_SIZE)) {
+        panic("zswap_load: slot %u is corrupt\n", slot);
+    }
+    return 0;
+}
+
+bool
+zswap_holds(unsigned slot)
+{
+    bool holds;
+
+    spinlock_acquire(&zswap_lock);
+    holds = (zswap_handle[slot] != ZSWAP_NONE);
+    spinlock_release(&zswap_lock);
+
+    return holds;
+}
+
+/*
+ *  zswap_invalidate - drop slot SLOT from the pool, and give back the
+ *  pool frame it leaves empty
+ *
+ */
+void
+zswap_invalidate(unsigned slot)
+{
+    struct zswap_page *zp;
+    uint32_t handle;
+    vaddr_t empty = 0;
+    unsigned n;
+
+    spinlock_acquire(&zswap_lock);
+    handle = zswap_handle[slot];
+    if (handle != ZSWAP_NONE) {
+        zp = &zswap_pages[handle / ZSWAP_NCHUNKS];
+        n = DIVROUNDUP(zswap_len[slot], ZSWAP_CHUNK);
+        zswap_chunk_set(zp, handle % ZSWAP_NCHUNKS, n, false);
+        zp->zp_nfree += n;
+        zswap_stored--;
+        zswap_bytes -= zswap_len[slot];
+        zswap_handle[slot] = ZSWAP_NONE;
+
+        if (zp->zp_nfree == ZSWAP_NCHUNKS) {
+            empty = zp->zp_kvaddr;
+            zp->zp_kvaddr = 0;
+            zswap_npages--;
+        }
+    }
+    spinlock_release(&zswap_lock);
+
+    if (empty != 0) {
+        free_kpages(empty);
+    }
+}
+
+/*
+ *  zswap_printstats - print how full the pool is and how it was used
+ *
+ */
+void
+zswap_printstats(void)
+{
+    kprintf("zswap: %u pages in %u of %u frames, %u bytes\n",
+            zswap_stored, zswap_npages, zswap_maxpages, zswap_bytes);
+    kprintf("zswap: %u stored, %u loaded, %u incompressible, %u sent to disk with the pool full\n",
+            zswap_stores, zswap_loads, zswap_rejects, zswap_overflows);
+}
+
+#endif
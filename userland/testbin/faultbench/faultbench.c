@@ -0,0 +1,135 @@
+/*
+ * faultbench - page fault throughput benchmark.
+ *
+ * Usage: faultbench [maxprocs]
+ *
+ * Runs rounds of 1, 2, 4, ... up to MAXPROCS (default 8) processes at
+ * once. Every process touches each page of a large untouched BSS
+ * array, so each touch is one zero-fill page fault, and the round
+ * reports the aggregate faults per second. With faults in different
+ * address spaces running in parallel, throughput should scale with
+ * the number of CPUs (boot with e.g. "cpus 4" in sys161.conf).
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define NPAGES     128		/* pages touched by each process */
+#define NPASSES    4		/* times each round is repeated */
+#define MAXPROCS   32
+
+static char pages[NPAGES * PAGESIZE];
+
+/*
+ * Use this instead of just calling printf so we know each printout
+ * is atomic; this prevents the lines from getting intermingled.
+ */
+static
+void
+say(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	write(STDOUT_FILENO, buf, strlen(buf));
+}
+
+static
+void
+touch(void)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		pages[i * PAGESIZE] = (char)i;
+	}
+}
+
+/*
+ * Return the time since START in milliseconds.
+ */
+static
+unsigned long
+elapsed_ms(time_t startsecs, unsigned long startnsecs)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	return (secs - startsecs) * 1000 + (nsecs - startnsecs) / 1000000;
+}
+
+static
+void
+runround(int nprocs)
+{
+	pid_t pids[MAXPROCS];
+	time_t startsecs;
+	unsigned long startnsecs, ms, faults;
+	int i, pass, status;
+
+	__time(&startsecs, &startnsecs);
+
+	for (pass=0; pass<NPASSES; pass++) {
+		for (i=0; i<nprocs; i++) {
+			pids[i] = fork();
+			if (pids[i] < 0) {
+				err(1, "fork");
+			}
+			if (pids[i] == 0) {
+				touch();
+				_exit(0);
+			}
+		}
+
+		for (i=0; i<nprocs; i++) {
+			if (waitpid(pids[i], &status, 0) < 0) {
+				err(1, "waitpid");
+			}
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				errx(1, "pid %d failed", pids[i]);
+			}
+		}
+	}
+
+	ms = elapsed_ms(startsecs, startnsecs);
+	if (ms == 0) {
+		ms = 1;
+	}
+	faults = (unsigned long)nprocs * NPAGES * NPASSES;
+	say("faultbench: %2d procs: %6lu faults in %6lu ms, %6lu faults/sec\n",
+	    nprocs, faults, ms, faults * 1000 / ms);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxprocs = 8;
+	int n;
+
+	if (argc > 1) {
+		maxprocs = atoi(argv[1]);
+	}
+	if (maxprocs < 1 || maxprocs > MAXPROCS) {
+		errx(1, "Usage: faultbench [maxprocs], 1 <= maxprocs <= %d",
+		     MAXPROCS);
+	}
+
+	for (n=1; n<=maxprocs; n*=2) {
+		runround(n);
+	}
+	return 0;
+}
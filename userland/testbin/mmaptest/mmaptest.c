@@ -0,0 +1,222 @@
+/*
+ * mmaptest - test mmap, munmap and msync on a file.
+ *
+ * Usage: mmaptest [file]
+ *
+ * Writes a test file (default "mmaptest.dat" in the current
+ * directory), then checks that:
+ *    - a mapping shows the file contents, including a zero tail in
+ *      the last page;
+ *    - stores through a MAP_SHARED mapping reach the file on msync
+ *      and on munmap;
+ *    - stores through a MAP_PRIVATE mapping never do;
+ *    - unmapping the middle of a mapping leaves both ends usable;
+ *    - MAP_ANON gives zero-filled memory;
+ *    - a MAP_SHARED mapping stays shared across fork, so parent and
+ *      child see each other's stores and neither undoes the other's.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define NPAGES     8
+#define FILESIZE   (NPAGES * PAGESIZE - 100)	/* last page is partial */
+
+static char buf[NPAGES * PAGESIZE];
+
+static
+char
+pattern(int i, int gen)
+{
+	return (char)(i * 7 + gen);
+}
+
+static
+void
+readback(const char *file, int gen, int first, int last)
+{
+	int fd, i;
+	ssize_t r;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	r = read(fd, buf, sizeof(buf));
+	if (r != FILESIZE) {
+		errx(1, "%s: read %ld bytes, expected %d",
+		     file, (long)r, FILESIZE);
+	}
+	close(fd);
+
+	for (i=first; i<last; i++) {
+		if (buf[i] != pattern(i, gen)) {
+			errx(1, "%s: byte %d is %d, expected %d", file, i,
+			     buf[i], pattern(i, gen));
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "mmaptest.dat";
+	char *p;
+	int fd, i, status;
+	pid_t pid;
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i, 0);
+	}
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", file);
+	}
+
+	printf("Mapping %s shared...\n", file);
+	p = mmap(NULL, NPAGES * PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	/* the mapping outlives the descriptor */
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i, 0)) {
+			errx(1, "mapped byte %d is %d, expected %d", i, p[i],
+			     pattern(i, 0));
+		}
+	}
+	for (i=FILESIZE; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "byte %d past the end of the file is %d",
+			     i, p[i]);
+		}
+	}
+
+	printf("Storing and syncing...\n");
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 1);
+	}
+	if (msync(p, NPAGES * PAGESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	readback(file, 1, 0, FILESIZE);
+
+	printf("Unmapping the middle...\n");
+	if (munmap(p + 2 * PAGESIZE, 2 * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	for (i=0; i<2 * PAGESIZE; i++) {
+		p[i] = pattern(i, 2);
+	}
+	for (i=4 * PAGESIZE; i<FILESIZE; i++) {
+		p[i] = pattern(i, 2);
+	}
+	if (munmap(p, NPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readback(file, 2, 0, 2 * PAGESIZE);
+	readback(file, 1, 2 * PAGESIZE, 4 * PAGESIZE);
+	readback(file, 2, 4 * PAGESIZE, FILESIZE);
+
+	printf("Mapping %s private...\n", file);
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	close(fd);
+	for (i=0; i<PAGESIZE; i++) {
+		p[i] = pattern(i, 3);
+	}
+	if (munmap(p, PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readback(file, 2, 0, PAGESIZE);
+
+	printf("Mapping anonymous memory...\n");
+	p = mmap(NULL, NPAGES * PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous byte %d is %d", i, p[i]);
+		}
+		p[i] = pattern(i, 4);
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != pattern(i, 4)) {
+			errx(1, "anonymous byte %d did not stick", i);
+		}
+	}
+	if (munmap(p, NPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("Sharing across fork...\n");
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mmap(NULL, NPAGES * PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	close(fd);
+	/* make every page resident, so fork has them to share */
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 5);
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<FILESIZE / 2; i++) {
+			p[i] = pattern(i, 6);
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	for (i=0; i<FILESIZE / 2; i++) {
+		if (p[i] != pattern(i, 6)) {
+			errx(1, "child's store to byte %d is not seen", i);
+		}
+	}
+	for (i=FILESIZE / 2; i<FILESIZE; i++) {
+		p[i] = pattern(i, 6);
+	}
+	if (munmap(p, NPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readback(file, 6, 0, FILESIZE);
+
+	remove(file);
+	printf("mmaptest done.\n");
+	return 0;
+}
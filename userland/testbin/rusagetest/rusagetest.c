@@ -0,0 +1,110 @@
+/*
+ * rusagetest - test the VM counters getrusage reports.
+ *
+ * Usage: rusagetest
+ *
+ * Checks that:
+ *    - touching fresh pages counts a minor fault each and raises the
+ *      resident and peak resident size;
+ *    - a child's faults and peak size show up under RUSAGE_CHILDREN
+ *      once it has been waited for, and not before.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define NPAGES     64
+
+static char buf[NPAGES * PAGESIZE];
+
+static
+void
+get(int who, struct rusage *ru)
+{
+	if (getrusage(who, ru)) {
+		err(1, "getrusage");
+	}
+}
+
+static
+void
+touch(void)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		buf[i * PAGESIZE] = (char)i;
+	}
+}
+
+static
+void
+show(const char *what, const struct rusage *ru)
+{
+	printf("%s: %llu minor, %llu major, %llu tlb refills, "
+	       "%llu swapped in, %llu swapped out, rss %u kb, max %u kb\n",
+	       what, ru->ru_minflt, ru->ru_majflt, ru->ru_ntlbrefill,
+	       ru->ru_nswapin, ru->ru_nswapout, ru->ru_rss, ru->ru_maxrss);
+}
+
+int
+main(void)
+{
+	struct rusage before, after, children;
+	pid_t pid;
+	int status;
+
+	get(RUSAGE_SELF, &before);
+	show("start", &before);
+
+	printf("Touching %d pages...\n", NPAGES);
+	touch();
+	get(RUSAGE_SELF, &after);
+	show("after", &after);
+	if (after.ru_minflt + after.ru_majflt <
+	    before.ru_minflt + before.ru_majflt + NPAGES) {
+		errx(1, "%d pages touched, fault count went up by less",
+		     NPAGES);
+	}
+	if (after.ru_rss < before.ru_rss + NPAGES * (PAGESIZE / 1024) ||
+	    after.ru_maxrss < after.ru_rss) {
+		errx(1, "resident size did not grow with the pages touched");
+	}
+
+	printf("Touching them again in a child...\n");
+	get(RUSAGE_CHILDREN, &children);
+	if (children.ru_minflt != 0 || children.ru_maxrss != 0) {
+		errx(1, "usage of children before there were any");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		/* every store breaks a copy-on-write share */
+		touch();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	get(RUSAGE_CHILDREN, &children);
+	show("children", &children);
+	if (children.ru_minflt < NPAGES) {
+		errx(1, "child's faults were not collected");
+	}
+	if (children.ru_maxrss < NPAGES * (PAGESIZE / 1024)) {
+		errx(1, "child's peak resident size was not collected");
+	}
+
+	printf("rusagetest done.\n");
+	return 0;
+}
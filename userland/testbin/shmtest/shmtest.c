@@ -0,0 +1,173 @@
+/*
+ * shmtest - test shm_open, shm_unlink and shared mappings.
+ *
+ * Usage: shmtest
+ *
+ * Checks that:
+ *    - a named object sized with ftruncate maps zero-filled;
+ *    - a child that opens the object by name and maps it sees the
+ *      parent's stores, and the parent sees the child's;
+ *    - a mapping inherited through fork stays shared;
+ *    - MAP_ANON|MAP_SHARED memory is shared with forked children;
+ *    - after shm_unlink the name is gone but the mapping still works.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define NPAGES     8
+#define SHMSIZE    (NPAGES * PAGESIZE)
+#define SHMNAME    "/shmtest"
+
+static
+char
+pattern(int i, int gen)
+{
+	return (char)(i * 7 + gen);
+}
+
+static
+void
+check(const char *what, const char *p, int gen)
+{
+	int i;
+
+	for (i=0; i<SHMSIZE; i++) {
+		if (p[i] != pattern(i, gen)) {
+			errx(1, "%s: byte %d is %d, expected %d", what, i,
+			     p[i], pattern(i, gen));
+		}
+	}
+}
+
+static
+void
+fill(char *p, int gen)
+{
+	int i;
+
+	for (i=0; i<SHMSIZE; i++) {
+		p[i] = pattern(i, gen);
+	}
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+static
+char *
+map(int fd)
+{
+	char *p;
+
+	p = mmap(NULL, SHMSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+int
+main(void)
+{
+	char *p, *q;
+	pid_t pid;
+	int fd, i;
+
+	/* left over from an earlier run that failed */
+	shm_unlink(SHMNAME);
+
+	printf("Creating %s...\n", SHMNAME);
+	fd = shm_open(SHMNAME, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0) {
+		err(1, "shm_open");
+	}
+	if (ftruncate(fd, SHMSIZE)) {
+		err(1, "ftruncate");
+	}
+	p = map(fd);
+	close(fd);
+	for (i=0; i<SHMSIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "new byte %d is %d", i, p[i]);
+		}
+	}
+	fill(p, 1);
+
+	printf("Opening it by name in a child...\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		fd = shm_open(SHMNAME, O_RDWR, 0);
+		if (fd < 0) {
+			err(1, "child: shm_open");
+		}
+		q = map(fd);
+		close(fd);
+		check("child", q, 1);
+		fill(q, 2);
+		/* and through the mapping inherited from the parent */
+		check("child, inherited", p, 2);
+		fill(p, 3);
+		_exit(0);
+	}
+	waitchild(pid);
+	check("parent", p, 3);
+
+	printf("Unlinking it...\n");
+	if (shm_unlink(SHMNAME)) {
+		err(1, "shm_unlink");
+	}
+	if (shm_open(SHMNAME, O_RDWR, 0) >= 0 || errno != ENOENT) {
+		errx(1, "%s still there after shm_unlink", SHMNAME);
+	}
+	check("after unlink", p, 3);
+	if (munmap(p, SHMSIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("Sharing anonymous memory with a child...\n");
+	p = mmap(NULL, SHMSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	fill(p, 4);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		check("child", p, 4);
+		fill(p, 5);
+		_exit(0);
+	}
+	waitchild(pid);
+	check("parent", p, 5);
+	if (munmap(p, SHMSIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("shmtest done.\n");
+	return 0;
+}